@@ -14,6 +14,7 @@ int main()
     char buf2[32]="";
 
     struct fifo_info info;
+    struct fifo_stats stats;
 
     fd=open("/dev/pchar0",O_RDWR);
     if(fd<0){
@@ -81,6 +82,18 @@ ret=ioctl(fd,FIFO_GET_INFO,&info);
 ret = ioctl(fd, FIFO_GET_INFO, &info);
 printf("After resize: size=%d, length=%d, avail=%d\n",
        info.size, info.length, info.avail);
+
+//64-bit counters
+ret = ioctl(fd, FIFO_GET_STATS, &stats);
+if(ret<0){
+    perror("ioctl FIFO_GET_STATS failed");
+    close(fd);
+    _exit(1);
+}
+printf("stats v%u: in=%llu out=%llu writes=%llu reads=%llu high_water=%llu errors=%llu\n",
+       stats.version, (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out,
+       (unsigned long long)stats.writes, (unsigned long long)stats.reads,
+       (unsigned long long)stats.high_water, (unsigned long long)stats.errors);
     // close device file
     close(fd);
     printf("device file closed.\n");
@@ -10,34 +10,246 @@
 #include <linux/cdev.h>
 #include <linux/slab.h>      /* kmalloc, kfree */
 #include <linux/uaccess.h>   /* copy_to_user, copy_from_user */
+#include <linux/uio.h>       /* iov_iter */
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>   /* kvmalloc, vmalloc_huge */
+#include <linux/log2.h>
+#include <linux/wait.h>
 #include "pchar_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "pchar_trace.h"
+
 static int pchar_open(struct inode *pinode, struct file *pfile);
 static int pchar_close(struct inode *pinode, struct file *pfile);
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset);
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset);
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to);
 static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+static const struct file_operations pchar_stats_fops;
 
 /* global variables */
-#define MAX 32
+#define MAX 32                       /* default fifo size */
+#define BUF_MAX (512 * 1024 * 1024)  /* largest fifo size */
+
+/* fifo size at load time -- FIFO_RESIZE changes it later */
+static unsigned int bufsize = MAX;
+module_param(bufsize, uint, 0444);
 
 static struct kfifo buffer;
 static dev_t devno;
 static struct class *pclass;
 static struct cdev pchar_cdev;
 
+/*
+ * kfifo is safe for one reader + one writer; these serialize readers and
+ * writers among themselves. FIFO_RESIZE/FIFO_CLEAR take both, wr_lock first.
+ */
+static DEFINE_MUTEX(wr_lock);
+static DEFINE_MUTEX(rd_lock);
+
+/*
+ * FIFO_SET_WRITE_MODE -- writes up to atomic_size land whole, FIFO_WRITE_ALL
+ * writes everything before returning. Once a mode is set, a writer that finds
+ * no room sleeps on wr_wq (or gets -EAGAIN) instead of getting -ENOSPC.
+ */
+static unsigned int atomic_size;
+static unsigned int write_flags;
+static bool write_mode;
+static DECLARE_WAIT_QUEUE_HEAD(wr_wq);
+
+/*
+ * FIFO_SET_OVERWRITE -- a write into a full fifo drops the oldest bytes
+ * instead, without rd_lock. rd_seq/lost back FIFO_GET_SEQ.
+ */
+static bool overwrite;
+static atomic64_t rd_seq = ATOMIC64_INIT(0); /* bytes taken off the head: read, skipped, dropped */
+static atomic64_t lost = ATOMIC64_INIT(0);   /* bytes dropped unread */
+
+/* per-CPU performance counters -- summed up on FIFO_GET_STATS / debugfs read */
+struct pchar_stats {
+    u64_stats_t bytes_in;
+    u64_stats_t bytes_out;
+    u64_stats_t writes;
+    u64_stats_t reads;
+    u64_stats_t wr_blocked;   /* readers never sleep here, so no rd_blocked */
+    u64_stats_t drops;
+    u64_stats_t errors;
+    struct u64_stats_sync syncp;
+};
+
+static struct pchar_stats __percpu *stats;
+static unsigned int high_water;      /* highest fill level seen */
+static struct dentry *pchar_dbg_dir; /* debugfs pchar/pchar0 */
+
+/*
+ * debug logging -- off by default and then costs only a patched-out branch
+ * (static key). toggle at runtime: echo 1 > /sys/module/pchar/parameters/debug
+ */
+static DEFINE_STATIC_KEY_FALSE(pchar_debug_key);
+#define pchar_dbg(fmt, ...)                                            \
+    do {                                                               \
+        if (static_branch_unlikely(&pchar_debug_key))                  \
+            pr_info("%s: " fmt, THIS_MODULE->name, ##__VA_ARGS__);     \
+    } while (0)
+
+static int pchar_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret = kstrtobool(val, &on);
+    if (ret < 0)
+        return ret;
+    if (on)
+        static_branch_enable(&pchar_debug_key);
+    else
+        static_branch_disable(&pchar_debug_key);
+    return 0;
+}
+
+static int pchar_debug_get(char *buf, const struct kernel_param *kp)
+{
+    return sprintf(buf, "%c\n", static_key_enabled(&pchar_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops pchar_debug_ops = {
+    .set = pchar_debug_set,
+    .get = pchar_debug_get,
+};
+module_param_cb(debug, &pchar_debug_ops, NULL, 0644);
+
 static const struct file_operations pchar_fops = {
     .owner = THIS_MODULE,
     .open = pchar_open,
     .release = pchar_close,
-    .write = pchar_write,
-    .read = pchar_read,
+    .write_iter = pchar_write_iter,
+    .read_iter = pchar_read_iter,
+    /* splice/sendfile: pipe pages are copied straight into/out of the fifo */
+    .splice_write = iter_file_splice_write,
+    .splice_read = copy_splice_read,
     .unlocked_ioctl = pchar_ioctl,
 };
 
-static int __init pchar_init(void)
+/* bump one per-CPU counter */
+#define pchar_stat_add(field, n)                                \
+    do {                                                        \
+        struct pchar_stats *__st = get_cpu_ptr(stats);          \
+        u64_stats_update_begin(&__st->syncp);                   \
+        u64_stats_add(&__st->field, (n));                       \
+        u64_stats_update_end(&__st->syncp);                     \
+        put_cpu_ptr(stats);                                     \
+    } while (0)
+
+/* account one write op of nbytes: tracepoint, counters, high-water mark */
+static void pchar_account_in(size_t nbytes)
 {
+    unsigned int len = kfifo_len(&buffer);
+
+    trace_pchar_enqueue(MINOR(devno), nbytes, len);
+    pchar_stat_add(bytes_in, nbytes);
+    pchar_stat_add(writes, 1);
+    if (len > READ_ONCE(high_water))
+        WRITE_ONCE(high_water, len);
+}
+
+/* account one read op of nbytes, called with rd_lock held */
+static void pchar_account_out(size_t nbytes)
+{
+    atomic64_add(nbytes, &rd_seq);
+    trace_pchar_dequeue(MINOR(devno), nbytes, kfifo_len(&buffer));
+    pchar_stat_add(bytes_out, nbytes);
+    pchar_stat_add(reads, 1);
+}
+
+static void pchar_get_stats(struct fifo_stats *fs)
+{
+    unsigned int start;
+    int cpu;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->version    = FIFO_STATS_VERSION;
+    fs->size       = kfifo_size(&buffer);
+    fs->length     = kfifo_len(&buffer);
+    fs->avail      = kfifo_avail(&buffer);
+    fs->high_water = READ_ONCE(high_water);
+
+    for_each_possible_cpu(cpu) {
+        const struct pchar_stats *st = per_cpu_ptr(stats, cpu);
+        u64 bytes_in, bytes_out, writes, reads, wr_blocked, drops, errors;
+
+        do {
+            start     = u64_stats_fetch_begin(&st->syncp);
+            bytes_in  = u64_stats_read(&st->bytes_in);
+            bytes_out = u64_stats_read(&st->bytes_out);
+            writes    = u64_stats_read(&st->writes);
+            reads     = u64_stats_read(&st->reads);
+            wr_blocked = u64_stats_read(&st->wr_blocked);
+            drops     = u64_stats_read(&st->drops);
+            errors    = u64_stats_read(&st->errors);
+        } while (u64_stats_fetch_retry(&st->syncp, start));
+
+        fs->bytes_in  += bytes_in;
+        fs->bytes_out += bytes_out;
+        fs->writes    += writes;
+        fs->reads     += reads;
+        fs->wr_blocked += wr_blocked;
+        fs->drops     += drops;
+        fs->errors    += errors;
+    }
+}
+
+static int pchar_stats_show(struct seq_file *m, void *v)
+{
+    struct fifo_stats fs;
+
+    pchar_get_stats(&fs);
+    seq_printf(m, "size: %llu\nlength: %llu\navail: %llu\nhigh_water: %llu\n",
+               fs.size, fs.length, fs.avail, fs.high_water);
+    seq_printf(m, "bytes_in: %llu\nbytes_out: %llu\nwrites: %llu\nreads: %llu\n",
+               fs.bytes_in, fs.bytes_out, fs.writes, fs.reads);
+    seq_printf(m, "wr_blocked: %llu\nrd_blocked: %llu\ndrops: %llu\nerrors: %llu\n",
+               fs.wr_blocked, fs.rd_blocked, fs.drops, fs.errors);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pchar_stats);
+
+/*
+ * kfifo_alloc() uses kmalloc, i.e. physically contiguous memory, which gets
+ * unreliable past a few pages. Large buffers come from vmalloc instead, mapped
+ * with huge pages where possible to cut TLB misses on a streaming copy.
+ * Like kfifo_alloc(), size is rounded up to a power of 2.
+ */
+static int pchar_fifo_alloc(struct kfifo *fifo, unsigned int size)
+{
+    void *data;
     int ret;
+
+    size = roundup_pow_of_two(max(size, 2U));
+    if (size >= PMD_SIZE)
+        data = vmalloc_huge(size, GFP_KERNEL);
+    else
+        data = kvmalloc(size, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    ret = kfifo_init(fifo, data, size);
+    if (ret)
+        kvfree(data);
+    return ret;
+}
+
+static void pchar_fifo_free(struct kfifo *fifo)
+{
+    kvfree(fifo->kfifo.data);
+    fifo->kfifo.data = NULL;
+}
+
+static int __init pchar_init(void)
+{
+    int ret, cpu;
     struct device *pdevice;
 
     pr_info("%s: pchar_init() called.\n", THIS_MODULE->name);
@@ -80,9 +292,9 @@ static int __init pchar_init(void)
     }
 
     /* 5) allocate kfifo */
-    ret = kfifo_alloc(&buffer, MAX, GFP_KERNEL);
+    ret = bufsize && bufsize <= BUF_MAX ? pchar_fifo_alloc(&buffer, bufsize) : -EINVAL;
     if (ret) {
-        pr_err("%s: kfifo_alloc() failed (%d)\n", THIS_MODULE->name, ret);
+        pr_err("%s: pchar_fifo_alloc() failed (%d)\n", THIS_MODULE->name, ret);
         cdev_del(&pchar_cdev);
         device_destroy(pclass, devno);
         class_destroy(pclass);
@@ -90,7 +302,23 @@ static int __init pchar_init(void)
         return ret;
     }
 
-    pr_info("%s: pchar driver loaded. /dev/pchar0 created (fifo size=%d)\n", THIS_MODULE->name, MAX);
+    /* 6) per-CPU counters, exported in debugfs pchar/pchar0/stats */
+    stats = alloc_percpu(struct pchar_stats);
+    if (!stats) {
+        pr_err("%s: alloc_percpu() failed\n", THIS_MODULE->name);
+        pchar_fifo_free(&buffer);
+        cdev_del(&pchar_cdev);
+        device_destroy(pclass, devno);
+        class_destroy(pclass);
+        unregister_chrdev_region(devno, 1);
+        return -ENOMEM;
+    }
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(stats, cpu)->syncp);
+    pchar_dbg_dir = debugfs_create_dir("pchar", NULL);
+    debugfs_create_file("stats", 0444, debugfs_create_dir("pchar0", pchar_dbg_dir), NULL, &pchar_stats_fops);
+
+    pr_info("%s: pchar driver loaded. /dev/pchar0 created (fifo size=%u)\n", THIS_MODULE->name, kfifo_size(&buffer));
     return 0;
 }
 
@@ -98,8 +326,10 @@ static void __exit pchar_exit(void)
 {
     pr_info("%s: pchar_exit() called.\n", THIS_MODULE->name);
 
-    /* free fifo, cdev and device/class, unregister region */
-    kfifo_free(&buffer);
+    /* free counters, fifo, cdev and device/class, unregister region */
+    debugfs_remove_recursive(pchar_dbg_dir);
+    free_percpu(stats);
+    pchar_fifo_free(&buffer);
     cdev_del(&pchar_cdev);
     device_destroy(pclass, devno);
     class_destroy(pclass);
@@ -110,63 +340,519 @@ static void __exit pchar_exit(void)
 
 static int pchar_open(struct inode *pinode, struct file *pfile)
 {
-    pr_info("%s: pchar_open() called.\n", THIS_MODULE->name);
+    /* read/write honor IOCB_NOWAIT -- io_uring may issue them inline */
+    pfile->f_mode |= FMODE_NOWAIT;
+    pchar_dbg("pchar_open() called.\n");
     return 0;
 }
 
 static int pchar_close(struct inode *pinode, struct file *pfile)
 {
-    pr_info("%s: pchar_close() called.\n", THIS_MODULE->name);
+    pchar_dbg("pchar_close() called.\n");
     return 0;
 }
 
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset)
+/*
+ * kfifo has no iov_iter interface -- copy the (up to two) contiguous
+ * regions directly, the same way kfifo_from_user() does.
+ */
+static size_t pchar_fifo_from_iter(struct kfifo *fifo, struct iov_iter *from, size_t len)
+{
+    struct __kfifo *kf = &fifo->kfifo;
+    unsigned int size = kf->mask + 1;
+    unsigned int off = kf->in & kf->mask;
+    size_t l, copied;
+
+    len = min_t(size_t, len, size - (kf->in - kf->out));
+    l = min_t(size_t, len, size - off);
+    copied = copy_from_iter((unsigned char *)kf->data + off, l, from);
+    if (copied == l && len > l)
+        copied += copy_from_iter(kf->data, len - l, from);
+    smp_wmb();   /* data visible before the new in index */
+    kf->in += copied;
+    return copied;
+}
+
+/*
+ * FIFO_WRITE_BATCH: copy all len bytes from user space into the free space
+ * and only then publish them -- unlike kfifo_from_user(), a fault part way
+ * queues nothing. Called with wr_lock held and len bytes free.
+ */
+static bool pchar_msg_from_user(struct kfifo *fifo, const void __user *buf, size_t len)
+{
+    struct __kfifo *kf = &fifo->kfifo;
+    unsigned int size = kf->mask + 1;
+    unsigned int off = kf->in & kf->mask;
+    size_t l = min_t(size_t, len, size - off);
+
+    if (copy_from_user((unsigned char *)kf->data + off, buf, l) ||
+        copy_from_user(kf->data, buf + l, len - l))
+        return false;
+    smp_wmb();   /* the whole message becomes visible at once */
+    kf->in += len;
+    return true;
+}
+
+/*
+ * Overwrite writers drop the head without rd_lock (see
+ * pchar_overwrite_make_room()), so a reader copies from the out index it
+ * loaded and then checks that out has not moved: pchar_head_kept() for a
+ * copy it leaves queued, pchar_release() for one it takes. false -- the copy
+ * may be torn, start over.
+ */
+static inline bool pchar_head_kept(struct __kfifo *kf, unsigned int out)
+{
+    smp_rmb();   /* the copy, then the check */
+    return READ_ONCE(kf->out) == out;
+}
+
+static inline bool pchar_release(struct __kfifo *kf, unsigned int out, unsigned int n)
+{
+    /* fully ordered -- data copied out before the slot is released */
+    return cmpxchg(&kf->out, out, out + n) == out;
+}
+
+/* copy up to len queued bytes from the out index seen into an iter */
+static size_t pchar_copy_to_iter(struct __kfifo *kf, unsigned int *out, struct iov_iter *to, size_t len)
+{
+    unsigned int size = kf->mask + 1;
+    unsigned int off;
+    size_t l, copied;
+
+    *out = READ_ONCE(kf->out);
+    off = *out & kf->mask;
+    len = min_t(size_t, len, smp_load_acquire(&kf->in) - *out);
+    l = min_t(size_t, len, size - off);
+    copied = copy_to_iter((unsigned char *)kf->data + off, l, to);
+    if (copied == l && len > l)
+        copied += copy_to_iter(kf->data, len - l, to);
+    return copied;
+}
+
+/* copy out from the head without consuming it, like kfifo_out_peek() */
+static size_t pchar_fifo_peek_to_iter(struct kfifo *fifo, struct iov_iter *to, size_t len)
+{
+    unsigned int out;
+    size_t copied;
+
+    for (;;) {
+        copied = pchar_copy_to_iter(&fifo->kfifo, &out, to, len);
+        if (pchar_head_kept(&fifo->kfifo, out))
+            return copied;
+        iov_iter_revert(to, copied);
+    }
+}
+
+/*
+ * counterpart of pchar_fifo_from_iter(), like kfifo_to_user(). returns 0
+ * on a fault, or if overwrite writers dropped all there was.
+ */
+static size_t pchar_fifo_to_iter(struct kfifo *fifo, struct iov_iter *to, size_t len)
+{
+    unsigned int out;
+    size_t copied;
+
+    for (;;) {
+        copied = pchar_copy_to_iter(&fifo->kfifo, &out, to, len);
+        if (pchar_release(&fifo->kfifo, out, copied))
+            return copied;
+        iov_iter_revert(to, copied);
+    }
+}
+
+/* non-blocking callers (IOCB_NOWAIT, O_NONBLOCK) only try the lock once */
+static int pchar_lock(struct mutex *lock, bool nowait)
+{
+    if (nowait)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(lock))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/* space was freed -- wake up writers waiting in pchar_wr_begin() */
+static void pchar_wake_writers(void)
+{
+    if (wq_has_sleeper(&wr_wq))
+        wake_up_interruptible(&wr_wq);
+}
+
+/*
+ * FIFO_SET_OVERWRITE: drop the oldest bytes until need are free. Called with
+ * wr_lock held and need <= the fifo size. An overwrite writer never waits,
+ * not even for a reader copying out: out moves past the dropped bytes
+ * without rd_lock, and a reader that was copying them sees its
+ * pchar_release() fail and starts over.
+ */
+static void pchar_overwrite_make_room(size_t need)
+{
+    struct __kfifo *kf = &buffer.kfifo;
+    unsigned int out, avail, drop;
+
+    do {
+        out = READ_ONCE(kf->out);
+        avail = kf->mask + 1 - (kf->in - out);
+        if (avail >= need)
+            return;   /* a reader made the room meanwhile */
+        drop = need - avail;
+    } while (cmpxchg(&kf->out, out, out + drop) != out);
+    atomic64_add(drop, &rd_seq);
+    atomic64_add(drop, &lost);
+    pchar_stat_add(drops, drop);
+}
+
+/* a writer waiting for need bytes can go on: room, never fits, or overwrite */
+static bool pchar_wr_ready(size_t need)
+{
+    return kfifo_avail(&buffer) >= need || kfifo_size(&buffer) < need || READ_ONCE(overwrite);
+}
+
+/*
+ * Take wr_lock once need bytes are free. Without a write mode the device
+ * keeps its old behaviour and fails with -ENOSPC when there is no room.
+ */
+static int pchar_wr_begin(size_t need, bool nowait)
 {
-    int nbytes = 0;
     int ret;
 
-    pr_info("%s: pchar_write() called (req=%zu)\n", THIS_MODULE->name, ubufsize);
+    for (;;) {
+        ret = pchar_lock(&wr_lock, nowait);
+        if (ret)
+            return ret;
+        if (kfifo_size(&buffer) < need) {
+            mutex_unlock(&wr_lock);
+            return -EMSGSIZE;   /* can never fit */
+        }
+        if (kfifo_avail(&buffer) >= need)
+            return 0;
+        if (READ_ONCE(overwrite)) {
+            pchar_overwrite_make_room(need);
+            return 0;
+        }
+        mutex_unlock(&wr_lock);
+        if (!READ_ONCE(write_mode))
+            return -ENOSPC;
+        if (nowait)
+            return -EAGAIN;
+        if (!pchar_wr_ready(need))
+            pchar_stat_add(wr_blocked, 1);   /* the wait below is going to sleep */
+        ret = wait_event_interruptible(wr_wq, pchar_wr_ready(need));
+        if (ret)
+            return -ERESTARTSYS;
+    }
+}
+
+/*
+ * Resize the device buffer while traffic flows. The new kfifo is allocated
+ * first, so a failed allocation leaves the old buffer in place. Writers and
+ * readers are then held off only for the kernel-to-kernel copy and pointer
+ * swap; the old buffer is freed after the locks are dropped.
+ * If the queued data does not fit, the newest bytes are dropped when
+ * truncate is set, otherwise nothing changes and -ENOSPC is returned.
+ * *truncated reports the bytes dropped (or that would have been).
+ */
+static int pchar_resize(int new_size, bool truncate, u64 *truncated)
+{
+    struct kfifo fifo;
+    unsigned int len, keep;
+    int ret;
 
-    if (kfifo_is_full(&buffer))
-        return -ENOSPC;
+    *truncated = 0;
+    if (new_size <= 0 || new_size > BUF_MAX)
+        return -EINVAL;
 
-    ret = kfifo_from_user(&buffer, ubuf, ubufsize, &nbytes);
-    if (ret < 0) {
-        pr_err("%s: kfifo_from_user() failed (%d)\n", THIS_MODULE->name, ret);
+    ret = pchar_fifo_alloc(&fifo, new_size);
+    if (ret)
         return ret;
+
+    mutex_lock(&wr_lock);
+    mutex_lock(&rd_lock);
+    len = kfifo_len(&buffer);
+    keep = min(len, kfifo_size(&fifo));
+    *truncated = len - keep;
+    if (*truncated && !truncate) {
+        ret = -ENOSPC;
+    } else {
+        /* new fifo is empty -- oldest bytes go straight into its linear start */
+        kfifo_out(&buffer, fifo.kfifo.data, keep);
+        fifo.kfifo.in = keep;
+        swap(buffer, fifo);
     }
+    mutex_unlock(&rd_lock);
+    mutex_unlock(&wr_lock);
 
-    return nbytes;
+    pchar_fifo_free(&fifo);   /* old buffer, or the unused new one */
+    pchar_wake_writers();     /* room changed -- or a waiter can never fit now */
+    return ret;
 }
 
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset)
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    int nbytes = 0;
+    size_t left = iov_iter_count(from);
+    size_t nbytes, need, total = 0;
+    bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
     int ret;
 
-    pr_info("%s: pchar_read() called (req=%zu)\n", THIS_MODULE->name, ubufsize);
+    pchar_dbg("pchar_write_iter() called (req=%zu)\n", left);
 
-    if (kfifo_is_empty(&buffer))
+    if (left == 0)
         return 0;
+    do {
+        /*
+         * writes up to atomic_size need room for all of it, others any room;
+         * in overwrite mode as much as fits, so the newest data goes in whole
+         */
+        if (left <= READ_ONCE(atomic_size))
+            need = left;
+        else if (READ_ONCE(overwrite))
+            need = min_t(size_t, left, kfifo_size(&buffer));
+        else
+            need = 1;
+        ret = pchar_wr_begin(need, nowait);
+        if (ret)
+            break;
+
+        nbytes = pchar_fifo_from_iter(&buffer, from, left);
+        if (nbytes > 0)
+            pchar_account_in(nbytes);
+        mutex_unlock(&wr_lock);
+        if (nbytes == 0) {
+            pchar_stat_add(errors, 1);
+            pchar_dbg("copy_from_iter() failed\n");
+            ret = -EFAULT;
+            break;
+        }
+        total += nbytes;
+        left -= nbytes;
+        /* FIFO_WRITE_ALL -- a blocking writer goes on until all of it is queued */
+    } while (left > 0 && !nowait && (READ_ONCE(write_flags) & FIFO_WRITE_ALL));
 
-    ret = kfifo_to_user(&buffer, ubuf, ubufsize, &nbytes);
-    if (ret < 0) {
-        pr_err("%s: kfifo_to_user() failed (%d)\n", THIS_MODULE->name, ret);
+    /* interrupted part way -- report what was queued */
+    return total ? total : ret;
+}
+
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    size_t count = iov_iter_count(to);
+    bool nowait = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    size_t nbytes;
+    int ret;
+
+    pchar_dbg("pchar_read_iter() called (req=%zu)\n", count);
+
+    if (count == 0)
+        return 0;
+    ret = pchar_lock(&rd_lock, nowait);
+    if (ret)
         return ret;
+    if (kfifo_is_empty(&buffer)) {
+        mutex_unlock(&rd_lock);
+        return 0;
+    }
+
+    nbytes = pchar_fifo_to_iter(&buffer, to, count);
+    if (nbytes > 0)
+        pchar_account_out(nbytes);
+    mutex_unlock(&rd_lock);
+    /* overwrite writers dropped it all meanwhile -- as if it had been empty */
+    if (nbytes == 0 && kfifo_is_empty(&buffer))
+        return 0;
+    if (nbytes == 0) {
+        pchar_stat_add(errors, 1);
+        pchar_dbg("copy_to_iter() failed\n");
+        return -EFAULT;
+    }
+    pchar_wake_writers();
+
+    return nbytes;
+}
+
+/*
+ * FIFO_WRITE_BATCH - each message goes into the fifo whole or not at all,
+ * stops at the first one that does not fit. Returns messages written.
+ */
+static long pchar_write_batch(struct fifo_batch __user *ubatch)
+{
+    struct fifo_batch batch;
+    struct fifo_msg msg;
+    struct fifo_msg __user *umsgs;
+    unsigned int i;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > FIFO_BATCH_MAX)
+        return -EINVAL;
+    umsgs = u64_to_user_ptr(batch.msgs);
+
+    if (mutex_lock_interruptible(&wr_lock))
+        return -ERESTARTSYS;
+    for (i = 0; i < batch.count; i++) {
+        if (copy_from_user(&msg, &umsgs[i], sizeof(msg))) {
+            ret = -EFAULT;
+            break;
+        }
+        /* overwrite -- a message that fits at all goes in over the oldest bytes */
+        if (msg.len > kfifo_size(&buffer) ||
+            (msg.len > kfifo_avail(&buffer) && !READ_ONCE(overwrite))) {
+            ret = -ENOSPC;
+            break;
+        }
+        if (msg.len > kfifo_avail(&buffer))
+            pchar_overwrite_make_room(msg.len);
+        if (!pchar_msg_from_user(&buffer, u64_to_user_ptr(msg.buf), msg.len)) {
+            pchar_stat_add(errors, 1);
+            ret = -EFAULT;
+            break;
+        }
+        pchar_account_in(msg.len);
+    }
+    mutex_unlock(&wr_lock);
+
+    /* report an error only if no message made it, like sendmmsg() */
+    if (i == 0 && batch.count > 0)
+        return ret;
+    if (put_user(i, &ubatch->done))
+        return -EFAULT;
+    return i;
+}
+
+/*
+ * FIFO_READ_BATCH - fills messages in order until the fifo is empty,
+ * each msg.len is updated with bytes read. Returns messages filled.
+ */
+static long pchar_read_batch(struct fifo_batch __user *ubatch)
+{
+    struct fifo_batch batch;
+    struct fifo_msg msg;
+    struct fifo_msg __user *umsgs;
+    struct iov_iter iter;
+    unsigned int i, nbytes;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > FIFO_BATCH_MAX)
+        return -EINVAL;
+    umsgs = u64_to_user_ptr(batch.msgs);
+
+    if (mutex_lock_interruptible(&rd_lock))
+        return -ERESTARTSYS;
+    for (i = 0; i < batch.count && !kfifo_is_empty(&buffer); i++) {
+        if (copy_from_user(&msg, &umsgs[i], sizeof(msg))) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = import_ubuf(ITER_DEST, u64_to_user_ptr(msg.buf), msg.len, &iter);
+        if (ret < 0)
+            break;
+        nbytes = pchar_fifo_to_iter(&buffer, &iter, msg.len);
+        if (nbytes == 0 && msg.len > 0) {
+            if (kfifo_is_empty(&buffer))
+                break;   /* overwrite writers dropped the rest */
+            pchar_stat_add(errors, 1);
+            ret = -EFAULT;
+            break;
+        }
+        pchar_account_out(nbytes);
+        if (put_user(nbytes, &umsgs[i].len)) {
+            ret = -EFAULT;
+            break;
+        }
     }
+    mutex_unlock(&rd_lock);
+    if (i > 0)
+        pchar_wake_writers();
+
+    if (i == 0 && ret < 0)
+        return ret;
+    if (put_user(i, &ubatch->done))
+        return -EFAULT;
+    return i;
+}
+
+/*
+ * FIFO_PEEK - copy the head of the fifo without consuming it, so a consumer
+ * can look at a header before deciding to read or skip the message.
+ */
+static long pchar_peek(struct fifo_peek __user *upeek, bool nowait)
+{
+    struct fifo_peek pk;
+    struct iov_iter iter;
+    size_t nbytes = 0;
+    int ret;
 
+    if (copy_from_user(&pk, upeek, sizeof(pk)))
+        return -EFAULT;
+    ret = import_ubuf(ITER_DEST, u64_to_user_ptr(pk.buf), pk.len, &iter);
+    if (ret < 0)
+        return ret;
+
+    ret = pchar_lock(&rd_lock, nowait);
+    if (ret)
+        return ret;
+    if (kfifo_is_empty(&buffer))
+        ret = -EAGAIN;
+    else if (pk.len > 0)
+        nbytes = pchar_fifo_peek_to_iter(&buffer, &iter, pk.len);
+    mutex_unlock(&rd_lock);
+    if (ret)
+        return ret;
+    if (pk.len > 0 && nbytes == 0)
+        return -EFAULT;
+
+    if (put_user(nbytes, &upeek->len))
+        return -EFAULT;
+    return nbytes;
+}
+
+/*
+ * FIFO_SKIP - drop up to count bytes from the head without copying them
+ * to user space. Counted as read. Returns the bytes dropped.
+ */
+static long pchar_skip(unsigned long count, bool nowait)
+{
+    unsigned int nbytes, out;
+    int ret;
+
+    if (count > INT_MAX)
+        return -EINVAL;
+    ret = pchar_lock(&rd_lock, nowait);
+    if (ret)
+        return ret;
+    do {
+        out = READ_ONCE(buffer.kfifo.out);
+        nbytes = min_t(unsigned int, count, smp_load_acquire(&buffer.kfifo.in) - out);
+    } while (!pchar_release(&buffer.kfifo, out, nbytes));   /* overwrite writers move it too */
+    if (nbytes > 0)
+        pchar_account_out(nbytes);
+    mutex_unlock(&rd_lock);
+
+    if (nbytes > 0)
+        pchar_wake_writers();
     return nbytes;
 }
 
 static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
 {
     struct fifo_info info;
+    struct fifo_stats fs;
+    struct fifo_resize rs;
+    struct fifo_write_mode wm;
+    struct fifo_seq sq;
+    u64 truncated;
     int ret = 0;
 
     switch (cmd) {
 
     case FIFO_CLEAR:
+        mutex_lock(&wr_lock);
+        mutex_lock(&rd_lock);
+        atomic64_add(kfifo_len(&buffer), &rd_seq);
         kfifo_reset(&buffer);
+        mutex_unlock(&rd_lock);
+        mutex_unlock(&wr_lock);
+        pchar_wake_writers();
         pr_info("%s: ioctl - FIFO_CLEAR\n", THIS_MODULE->name);
         return 0;
 
@@ -181,61 +867,77 @@ static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long para
             return -EFAULT;
         }
 
-        pr_info("%s: ioctl - FIFO_GET_INFO (size=%d length=%d avail=%d)\n",
-                THIS_MODULE->name, info.size, info.length, info.avail);
+        pchar_dbg("ioctl - FIFO_GET_INFO (size=%d length=%d avail=%d)\n",
+                  info.size, info.length, info.avail);
         return 0;
 
-    case FIFO_RESIZE: {
-        int new_size = (int)param;
-        int old_len;
-        unsigned char *temp = NULL;
-        int copied;
+    case FIFO_GET_STATS:
+        /* 64-bit counters -- struct fifo_info overflows past 32 KiB */
+        pchar_get_stats(&fs);
+        if (copy_to_user((void __user *)param, &fs, sizeof(fs)))
+            return -EFAULT;
+        return 0;
 
-        pr_info("%s: ioctl - FIFO_RESIZE requested size=%d\n", THIS_MODULE->name, new_size);
+    case FIFO_RESIZE:
+        /* legacy form -- never truncates, -ENOSPC if the data would not fit */
+        ret = pchar_resize((int)param, false, &truncated);
+        pr_info("%s: ioctl FIFO_RESIZE - size=%d ret=%d\n", THIS_MODULE->name, (int)param, ret);
+        return ret;
 
-        if (new_size <= 0) {
-            pr_err("%s: ioctl FIFO_RESIZE - invalid size %d\n", THIS_MODULE->name, new_size);
+    case FIFO_RESIZE2:
+        if (copy_from_user(&rs, (void __user *)param, sizeof(rs)))
+            return -EFAULT;
+        if (rs.size > INT_MAX || (rs.flags & ~FIFO_RESIZE_TRUNCATE))
             return -EINVAL;
-        }
+        ret = pchar_resize(rs.size, rs.flags & FIFO_RESIZE_TRUNCATE, &rs.truncated);
+        /* report truncation even when it was refused */
+        if (put_user(rs.truncated, &((struct fifo_resize __user *)param)->truncated))
+            return -EFAULT;
+        pr_info("%s: ioctl FIFO_RESIZE2 - size=%u ret=%d truncated=%llu\n",
+                THIS_MODULE->name, rs.size, ret, rs.truncated);
+        return ret;
 
-        
-        old_len = kfifo_len(&buffer);
-        if (old_len > 0) {
-            temp = kmalloc(old_len, GFP_KERNEL);
-            if (!temp) {
-                pr_err("%s: ioctl FIFO_RESIZE - kmalloc failed\n", THIS_MODULE->name);
-                return -ENOMEM;
-            }
-
-            
-            copied = kfifo_out(&buffer, temp, old_len);
-        } else {
-            copied = 0;
-        }
+    case FIFO_SET_WRITE_MODE:
+        if (copy_from_user(&wm, (void __user *)param, sizeof(wm)))
+            return -EFAULT;
+        if (wm.atomic_size > BUF_MAX || (wm.flags & ~FIFO_WRITE_ALL))
+            return -EINVAL;
+        WRITE_ONCE(atomic_size, wm.atomic_size);
+        WRITE_ONCE(write_flags, wm.flags);
+        WRITE_ONCE(write_mode, true);
+        pr_info("%s: ioctl FIFO_SET_WRITE_MODE - atomic=%u flags=0x%x\n",
+                THIS_MODULE->name, wm.atomic_size, wm.flags);
+        return 0;
 
-        
-        kfifo_free(&buffer);
+    case FIFO_WRITE_BATCH:
+        /* hot path -- no logging per call */
+        return pchar_write_batch((struct fifo_batch __user *)param);
 
-        
-        ret = kfifo_alloc(&buffer, new_size, GFP_KERNEL);
-        if (ret) {
-            pr_err("%s: ioctl FIFO_RESIZE - kfifo_alloc failed (%d)\n", THIS_MODULE->name, ret);
-            if (temp)
-                kfree(temp);
-            return ret;
-        }
+    case FIFO_READ_BATCH:
+        return pchar_read_batch((struct fifo_batch __user *)param);
 
-        
-        if (copied > 0 && temp) {
-            int copy_len = (copied < new_size) ? copied : new_size;
-            kfifo_in(&buffer, temp, copy_len);
-            kfree(temp);
-        }
+    case FIFO_SET_OVERWRITE:
+        WRITE_ONCE(overwrite, param != 0);
+        /* blocked writers go on by dropping the oldest bytes now */
+        if (param)
+            wake_up_interruptible_all(&wr_wq);
+        pr_info("%s: ioctl FIFO_SET_OVERWRITE - %s\n", THIS_MODULE->name, param ? "on" : "off");
+        return 0;
 
-        pr_info("%s: ioctl FIFO_RESIZE - resized to %d (restored=%d)\n",
-                THIS_MODULE->name, new_size, copied);
+    case FIFO_GET_SEQ:
+        mutex_lock(&rd_lock);
+        sq.seq  = atomic64_read(&rd_seq);
+        sq.lost = atomic64_read(&lost);
+        mutex_unlock(&rd_lock);
+        if (copy_to_user((void __user *)param, &sq, sizeof(sq)))
+            return -EFAULT;
         return 0;
-    }
+
+    case FIFO_PEEK:
+        return pchar_peek((struct fifo_peek __user *)param, pfile->f_flags & O_NONBLOCK);
+
+    case FIFO_SKIP:
+        return pchar_skip(param, pfile->f_flags & O_NONBLOCK);
 
     default:
         pr_err("%s: ioctl - invalid cmd 0x%x\n", THIS_MODULE->name, cmd);
@@ -3,6 +3,7 @@
 #define __PCHAR_IOCTL_H
 
 #include<linux/ioctl.h>
+#include<linux/types.h>
 
 struct fifo_info
 {
@@ -11,8 +12,108 @@ struct fifo_info
     short avail;
 };
 
+// one message of a FIFO_WRITE_BATCH / FIFO_READ_BATCH request
+struct fifo_msg
+{
+    __u64 buf;  // user buffer address
+    __u32 len;  // in: buffer length; out (read batch): bytes read
+    __u32 pad;
+};
+
+// batch request -- the ioctl returns the number of messages completed (like sendmmsg)
+struct fifo_batch
+{
+    __u64 msgs;  // address of struct fifo_msg array
+    __u32 count; // number of messages in the array (<= FIFO_BATCH_MAX)
+    __u32 done;  // out: number of messages completed
+};
+
+#define FIFO_BATCH_MAX 1024
+
+// FIFO_GET_STATS -- per device counters, all 64 bit. version is set by the
+// driver; new fields are only ever appended (and FIFO_STATS_VERSION bumped).
+#define FIFO_STATS_VERSION 1
+struct fifo_stats
+{
+    __u32 version;     // FIFO_STATS_VERSION of the driver
+    __u32 pad;
+    __u64 size;        // buffer size (bytes)
+    __u64 length;      // bytes queued now
+    __u64 avail;       // bytes free now
+    __u64 high_water;  // highest fill level seen (bytes)
+    __u64 bytes_in;    // bytes written
+    __u64 bytes_out;   // bytes read
+    __u64 writes;      // write ops
+    __u64 reads;       // read ops
+    __u64 wr_blocked;  // times a writer slept on a full buffer
+    __u64 rd_blocked;  // times a reader slept on an empty buffer (reads never block: 0)
+    __u64 drops;       // bytes dropped
+    __u64 errors;      // failed transfers
+    // version 2 -- kept for layout compatibility with the assign2 driver, which
+    // fills them. This driver reports version 1 and leaves them 0.
+    __u64 wakeups;          // wakeups that found a blocked process
+    __u64 wakeups_avoided;  // wake-one wakeups that left other blocked processes asleep
+};
+
+// FIFO_RESIZE2 -- resize while traffic flows. Without FIFO_RESIZE_TRUNCATE a
+// resize that cannot keep all queued data fails with ENOSPC. truncated reports
+// the bytes dropped (or that would have been dropped).
+#define FIFO_RESIZE_TRUNCATE 0x1 // drop the newest bytes that do not fit
+struct fifo_resize
+{
+    __u32 size;       // new size in bytes (rounded up to a power of 2)
+    __u32 flags;      // FIFO_RESIZE_*
+    __u64 truncated;  // out: bytes dropped
+};
+
+// FIFO_SET_WRITE_MODE -- write() semantics. A write of up to atomic_size bytes
+// lands whole or not at all: it blocks until there is room for all of it, or
+// fails with EAGAIN on a non-blocking fd (0: writes take whatever fits).
+// With FIFO_WRITE_ALL a blocking write() returns only once the entire request
+// is queued (or on a signal, with the bytes queued so far).
+// Until a mode is set, a write to a full device fails with ENOSPC.
+#define FIFO_WRITE_ALL 0x1
+struct fifo_write_mode
+{
+    __u32 atomic_size; // bytes, <= buffer size to be useful
+    __u32 flags;       // FIFO_WRITE_*
+};
+
+// FIFO_GET_SEQ -- seq counts the bytes ever taken off the head of the buffer,
+// read, skipped, cleared or dropped: the sequence number of the next one
+// read() returns. A reader that got n since the last call expects seq to have
+// moved by n -- any more is a gap. lost counts the ones dropped unread.
+struct fifo_seq
+{
+    __u64 seq;
+    __u64 lost;
+};
+
+// FIFO_PEEK -- copy what the next read() would return without consuming it.
+// Returns the bytes copied; never waits: EAGAIN if empty.
+struct fifo_peek
+{
+    __u64 buf;  // user buffer address
+    __u32 len;  // in: buffer length; out: bytes copied
+    __u32 pad;
+};
+
 #define FIFO_CLEAR _IO('x',1)
 #define FIFO_GET_INFO _IOR('x',2,struct fifo_info)
 #define FIFO_RESIZE  _IOW('x',3,int)
+#define FIFO_WRITE_BATCH _IOWR('x',6,struct fifo_batch)
+#define FIFO_READ_BATCH  _IOWR('x',7,struct fifo_batch)
+#define FIFO_GET_STATS _IOWR('x',10,struct fifo_stats)
+#define FIFO_RESIZE2 _IOWR('x',11,struct fifo_resize)
+#define FIFO_SET_WRITE_MODE _IOW('x',14,struct fifo_write_mode)
+#define FIFO_PEEK _IOWR('x',19,struct fifo_peek)
+// drop the next param bytes without copying them out. returns the bytes dropped.
+#define FIFO_SKIP _IOW('x',20,int)
+// overwrite (flight recorder) mode -- a write into a full buffer drops the oldest
+// bytes (counted in drops) instead of blocking or failing with ENOSPC -- even
+// the bytes a reader is copying out right then, whose read then goes on with
+// the oldest bytes left. param: 1 = on, 0 = off.
+#define FIFO_SET_OVERWRITE _IOW('x',23,int)
+#define FIFO_GET_SEQ _IOR('x',24,struct fifo_seq)
 
 #endif
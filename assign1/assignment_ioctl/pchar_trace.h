@@ -0,0 +1,68 @@
+// tracepoints for the pchar drivers -- enable with
+//   echo 1 > /sys/kernel/tracing/events/pchar/enable
+// or record with: perf record -e 'pchar:*'
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pchar
+
+#if !defined(_PCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// data moved into / out of a device buffer; len is the buffer fill level afterwards
+DECLARE_EVENT_CLASS(pchar_xfer,
+    TP_PROTO(unsigned int minor, size_t bytes, unsigned int len),
+    TP_ARGS(minor, bytes, len),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, bytes)
+        __field(unsigned int, len)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->bytes = bytes;
+        __entry->len = len;
+    ),
+    TP_printk("pchar%u bytes=%zu len=%u", __entry->minor, __entry->bytes, __entry->len)
+);
+
+DEFINE_EVENT(pchar_xfer, pchar_enqueue,
+    TP_PROTO(unsigned int minor, size_t bytes, unsigned int len),
+    TP_ARGS(minor, bytes, len));
+
+DEFINE_EVENT(pchar_xfer, pchar_dequeue,
+    TP_PROTO(unsigned int minor, size_t bytes, unsigned int len),
+    TP_ARGS(minor, bytes, len));
+
+// a reader/writer goes to sleep on the device, or sleepers are woken up
+DECLARE_EVENT_CLASS(pchar_sched,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(bool, writer)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writer = writer;
+    ),
+    TP_printk("pchar%u %s", __entry->minor, __entry->writer ? "writer" : "reader")
+);
+
+DEFINE_EVENT(pchar_sched, pchar_block,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer));
+
+DEFINE_EVENT(pchar_sched, pchar_wake,
+    TP_PROTO(unsigned int minor, bool writer),
+    TP_ARGS(minor, writer));
+
+#endif // _PCHAR_TRACE_H
+
+// this header lives next to the driver sources, not in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pchar_trace
+#include <trace/define_trace.h>
@@ -5,34 +5,235 @@
 #include <linux/module.h>
 #include <linux/kfifo.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/cache.h>
+#include <linux/smp.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/xarray.h>
+#include <linux/miscdevice.h>
+#include <linux/workqueue.h>
+#include <linux/ctype.h>
+#include "pchar_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "pchar_trace.h"
 
 // device operations
 static int pchar_open(struct inode *pinode, struct file *pfile);
 static int pchar_close(struct inode *pinode, struct file *pfile);
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset);
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset);
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait);
+static int pchar_fasync(int fd, struct file *pfile, int on);
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+static int pchar_mmap(struct file *pfile, struct vm_area_struct *vma);
+static long pchar_ctl_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
+static const struct file_operations pchar_stats_fops;
+
+// device attributes (sysfs)
+static ssize_t bufsize_show(struct device *d, struct device_attribute *attr, char *buf);
+static ssize_t bufsize_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count);
+static DEVICE_ATTR_RW(bufsize);
+static struct attribute *pchar_attrs[] = {
+    &dev_attr_bufsize.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(pchar);
 
 // device & its related info -- device private struct
-#define MAX 32
+#define MAX 32                       // default buffer size
+#define BUF_MAX (512 * 1024 * 1024)  // largest buffer size -- all queues of a device together
+#define BUFSIZE_DEVS 32              // devices sizable by the bufsize= param
+#define PCHAR_MINORS 256             // device numbers reserved for instances
+#define RING_MAX (64 * 1024 * 1024) // largest mmap ring data area
+#define PCHAR_REC_HDR sizeof(u32)    // record mode: length prefix of each record
+#define FLUSH_MAX_NS NSEC_PER_SEC    // longest wakeup flush deadline
+
+// wake_pending bits -- a wakeup held back by a watermark
+#define PCHAR_PEND_RD 0
+#define PCHAR_PEND_WR 1
+
+// per-CPU performance counters -- summed up on FIFO_GET_STATS / debugfs read
+typedef struct pchar_stats
+{
+    u64_stats_t bytes_in;
+    u64_stats_t bytes_out;
+    u64_stats_t writes;      // write ops (write() calls, batch messages)
+    u64_stats_t reads;       // read ops
+    u64_stats_t wr_blocked;  // writer slept on a full buffer
+    u64_stats_t rd_blocked;  // reader slept on an empty buffer
+    u64_stats_t drops;       // bytes dropped
+    u64_stats_t errors;      // failed transfers (faults)
+    u64_stats_t wakeups;     // wakeups that found a sleeper
+    u64_stats_t wakeups_avoided; // wake-one wakeups that left other exclusive sleepers asleep
+    struct u64_stats_sync syncp;
+} pchar_stats_t;
+
+// one device buffer -- a device has one, one per CPU in sharded mode, or one
+// per priority lane
+typedef struct pchar_queue
+{
+    struct kfifo fifo;       // the buffer
+    struct mutex wr_lock;    // serializes producers of this queue
+} ____cacheline_aligned_in_smp pchar_queue_t;
+
+// Each instance is allocated on its own (on its NUMA node, if given). Fields
+// are grouped by who writes them: read-mostly setup and config first, then the
+// producer side and the consumer side on cache lines of their own, so that
+// writers and readers of one device (or of two devices) do not bounce lines.
 typedef struct pchar_device
 {
-    struct kfifo buffer;     // the device buffer
+    // read mostly -- set at create, changed by ioctl()s
+    pchar_queue_t *queues;   // the device buffer(s)
+    unsigned int nqueues;    // 1, nr_cpu_ids when sharded, or nlanes
+    unsigned int nlanes;     // priority lanes, queues[0] lowest (0: none -- round-robin)
+    unsigned int lane_quota; // lanes: reads in a row from a higher lane before a lower one gets one (0: strict)
+    int node;                // NUMA node of this state and the buffers (NUMA_NO_NODE: any)
+    pchar_stats_t __percpu *stats; // performance counters
     struct cdev cdev;        // cdev struct for the device
-    wait_queue_head_t wr_wq; // to block writer process, when buffer is full.
-    wait_queue_head_t rd_wq;
+    struct device device;    // /sys/class/pchar_class/<name> -- owns this struct (refcounted)
+    struct dentry *dbg_dir;  // debugfs pchar/<name> directory
+    struct fasync_struct *async_queue; // SIGIO subscribers (fasync)
+    unsigned int rd_wmark;   // wake readers once this many bytes are queued (0/1: always)
+    unsigned int wr_wmark;   // wake writers once this many bytes are free (0/1: always)
+    u64 flush_ns;            // deliver a held back wakeup at most this late (0: no deadline)
+    bool record;             // record mode -- each write is one length-prefixed record
+    unsigned int bcast;      // broadcast policy FIFO_BCAST_* (0: off) -- one queue only
+    bool overwrite;          // FIFO_SET_OVERWRITE -- a full queue drops its oldest data instead of blocking
+    unsigned int atomic_size; // byte mode writes up to this size land whole (0: none)
+    unsigned int write_flags; // FIFO_WRITE_*
+    void *ring;              // mmap ring mode: control page + data (vmalloc_user), NULL otherwise
+    struct pchar_ring_ctrl *ring_ctrl; // == ring, published after ring is initialized
+    u32 ring_size;           // kernel copy of ring data size (ctrl page is user writable)
+    struct pchar_device *link; // FIFO_LINK: forward queued data to this device (NULL: none)
+    bool linked;             // some device forwards into this one
+    struct mutex ctl_lock;   // serializes ioctl() configuration changes
+    unsigned int users;      // open files, under ctl_lock
+    bool dead;               // destroyed -- refuse new opens, under ctl_lock
+
+    // written by either side, but only now and then
+    unsigned int high_water ____cacheline_aligned_in_smp; // highest fill level seen on a device queue
+    unsigned long wake_pending; // PCHAR_PEND_* bits
+    struct hrtimer flush_timer; // flush_ns deadline
+
+    // producer side
+    wait_queue_head_t wr_wq ____cacheline_aligned_in_smp; // to block writer process, when buffer is full.
+    atomic_t wr_excl;        // exclusive sleepers on wr_wq
+    struct work_struct fwd_work; // FIFO_LINK: moves queued data downstream, queued on writes
+
+    // consumer side
+    struct mutex rd_lock ____cacheline_aligned_in_smp; // serializes consumers
+    unsigned int next_rd;    // sharded: queue to drain first (round-robin), under rd_lock
+    unsigned int lane_streak; // lanes: reads that passed over a waiting lower lane, under rd_lock
+    atomic64_t rd_seq;       // bytes (records) taken off the head -- read, or dropped by overwrite writers
+    atomic64_t lost;         // bytes (records) dropped unread
+    wait_queue_head_t rd_wq; // to block reader process, when buffer is empty.
+    atomic_t rd_excl;        // exclusive sleepers on rd_wq
+    struct list_head readers; // files open for reading (broadcast cursors), under rd_lock
 } pchar_device_t;
 
-// number of devices -- flexible via module param
+// per open file state
+typedef struct pchar_file
+{
+    pchar_device_t *dev;
+    pchar_queue_t *txq;      // queue this file writes to -- set at open (or FIFO_SET_LANE), keeps per-producer order
+    struct list_head rd_node; // on dev->readers if open for reading
+    unsigned int rd_pos;     // broadcast: read cursor (kfifo index), under rd_lock
+    bool lagged;             // broadcast: unread data was dropped, under rd_lock
+} pchar_file_t;
+
+static bool pchar_bcast_reclaim(pchar_device_t *dev);
+static u32 pchar_rec_len_at(struct __kfifo *kf, unsigned int pos);
+static int pchar_bcast_make_room(pchar_device_t *dev, pchar_queue_t *q, size_t len, bool nowait);
+static void pchar_notify_writers(pchar_device_t *dev);
+static enum hrtimer_restart pchar_flush_timer(struct hrtimer *timer);
+static void pchar_fwd_work(struct work_struct *work);
+
+// number of devices created at load (pchar0...) -- more via /dev/pchar_ctl
 static int devcnt = 4;
 module_param(devcnt, int, 0444);
 
-// devices private struct dynamic array
-static pchar_device_t *devices;
+// per device buffer size at load time, e.g. bufsize=4096,268435456 -- devices
+// not listed (or 0) get MAX. change later via sysfs pcharN/bufsize or FIFO_RESIZE.
+static unsigned int bufsize[BUFSIZE_DEVS];
+static int nbufsize;
+module_param_array(bufsize, uint, &nbufsize, 0444);
+
+// per device NUMA node at load time, e.g. numa_node=0,1 -- put state and buffers
+// near the producers. devices not listed (or -1) allocate from any node.
+static int numa_node[BUFSIZE_DEVS];
+static int nnuma_node;
+module_param_array(numa_node, int, &nnuma_node, 0444);
+
+// sharded mode -- per-CPU sub-fifos, writers enqueue to the queue of the CPU they opened on
+static bool sharded;
+module_param(sharded, bool, 0444);
+
+// priority lanes of the load time devices (0: none) -- not with sharded
+static unsigned int lanes;
+module_param(lanes, uint, 0444);
+
+// debug logging -- off by default and then costs only a patched-out branch (static key).
+// toggle at runtime: echo 1 > /sys/module/<module>/parameters/debug
+static DEFINE_STATIC_KEY_FALSE(pchar_debug_key);
+#define pchar_dbg(fmt, ...)                                            \
+    do                                                                 \
+    {                                                                  \
+        if (static_branch_unlikely(&pchar_debug_key))                  \
+            pr_info("%s: " fmt, THIS_MODULE->name, ##__VA_ARGS__);     \
+    } while (0)
+
+static int pchar_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret = kstrtobool(val, &on);
+    if (ret < 0)
+        return ret;
+    if (on)
+        static_branch_enable(&pchar_debug_key);
+    else
+        static_branch_disable(&pchar_debug_key);
+    return 0;
+}
+
+static int pchar_debug_get(char *buf, const struct kernel_param *kp)
+{
+    return sprintf(buf, "%c\n", static_key_enabled(&pchar_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops pchar_debug_ops = {
+    .set = pchar_debug_set,
+    .get = pchar_debug_get,
+};
+module_param_cb(debug, &pchar_debug_ops, NULL, 0644);
+
+// device instance table -- minor -> device, filled at load and by /dev/pchar_ctl
+static DEFINE_XARRAY_ALLOC(pchar_devs);
+static DEFINE_MUTEX(pchar_devs_lock); // serializes instance create/destroy
+
+// debugfs root -- /sys/kernel/debug/pchar
+static struct dentry *pchar_dbg_root;
+
+// FIFO_LINK forwarding -- the work items may sleep on a full downstream device
+static struct workqueue_struct *pchar_fwd_wq;
 
 // other global variables
 static dev_t devno;
@@ -42,28 +243,356 @@ static struct file_operations pchar_fops = {
     .owner = THIS_MODULE,
     .open = pchar_open,
     .release = pchar_close,
-    .write = pchar_write,
-    .read = pchar_read,
+    .write_iter = pchar_write_iter,
+    .read_iter = pchar_read_iter,
+    // splice/sendfile -- pipe pages go through write_iter/read_iter as bvecs,
+    // one copy into/out of the fifo and no user space bounce buffer
+    .splice_write = iter_file_splice_write,
+    .splice_read = copy_splice_read,
+    .poll = pchar_poll,
+    .fasync = pchar_fasync,
+    .unlocked_ioctl = pchar_ioctl,
+    .mmap = pchar_mmap,
+};
+
+// control node -- /dev/pchar_ctl creates and destroys instances
+static const struct file_operations pchar_ctl_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = pchar_ctl_ioctl,
 };
+static struct miscdevice pchar_ctl_misc = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "pchar_ctl",
+    .fops = &pchar_ctl_fops,
+    .mode = 0600,
+};
+
+// kfifo_alloc() needs physically contiguous (kmalloc) memory, which fails for
+// large sizes. Big buffers come from vmalloc, mapped with huge pages where
+// possible to cut TLB misses. Size is rounded up to a power of 2 like kfifo_alloc().
+// A buffer bound to a NUMA node comes from kvmalloc_node() instead.
+static int pchar_fifo_alloc(struct kfifo *fifo, unsigned int size, int node)
+{
+    void *data;
+    int ret;
+
+    size = roundup_pow_of_two(max(size, 2U));
+    if (size >= PMD_SIZE && node == NUMA_NO_NODE)
+        data = vmalloc_huge(size, GFP_KERNEL);
+    else
+        data = kvmalloc_node(size, GFP_KERNEL, node);
+    if (data == NULL)
+        return -ENOMEM;
+    ret = kfifo_init(fifo, data, size);
+    if (ret < 0)
+        kvfree(data);
+    return ret;
+}
+
+static void pchar_fifo_free(struct kfifo *fifo)
+{
+    kvfree(fifo->kfifo.data);
+    fifo->kfifo.data = NULL;
+}
+
+// n queues of size bytes each stay within BUF_MAX -- a sharded device has
+// nr_cpu_ids of them, which must not multiply the memory one device may pin
+static inline bool pchar_size_ok(unsigned int n, unsigned int size)
+{
+    return size > 0 && size <= BUF_MAX && (u64)roundup_pow_of_two(max(size, 2U)) * n <= BUF_MAX;
+}
+
+// allocate device buffer(s) -- n queues of size bytes each -- and counters
+static int pchar_alloc_queues(pchar_device_t *dev, unsigned int n, unsigned int size)
+{
+    unsigned int i;
+    int ret, cpu;
+
+    if (!pchar_size_ok(n, size))
+        return -EINVAL;
+    dev->stats = alloc_percpu(pchar_stats_t);
+    if (dev->stats == NULL)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(dev->stats, cpu)->syncp);
+    dev->queues = kcalloc_node(n, sizeof(pchar_queue_t), GFP_KERNEL, dev->node);
+    if (dev->queues == NULL)
+    {
+        free_percpu(dev->stats);
+        dev->stats = NULL;
+        return -ENOMEM;
+    }
+    for (i = 0; i < n; i++)
+    {
+        ret = pchar_fifo_alloc(&dev->queues[i].fifo, size, dev->node);
+        if (ret < 0)
+            goto kfifo_alloc_failed;
+        mutex_init(&dev->queues[i].wr_lock);
+    }
+    dev->nqueues = n;
+    return 0;
+
+kfifo_alloc_failed:
+    while (i-- > 0)
+    {
+        mutex_destroy(&dev->queues[i].wr_lock);
+        pchar_fifo_free(&dev->queues[i].fifo);
+    }
+    kfree(dev->queues);
+    free_percpu(dev->stats);
+    dev->queues = NULL; // pchar_free_queues() is a no-op now
+    dev->stats = NULL;
+    return ret;
+}
+
+static void pchar_free_queues(pchar_device_t *dev)
+{
+    unsigned int i;
+    for (i = 0; i < dev->nqueues; i++)
+    {
+        mutex_destroy(&dev->queues[i].wr_lock);
+        pchar_fifo_free(&dev->queues[i].fifo);
+    }
+    kfree(dev->queues);
+    free_percpu(dev->stats);
+}
+
+// set up the waiting queues, locks and timer of a zeroed dev -- the rest starts
+// out as byte stream mode, no wakeup moderation, no mmap ring
+static void pchar_dev_init(pchar_device_t *dev, int node)
+{
+    dev->node = node;
+    init_waitqueue_head(&dev->wr_wq);
+    init_waitqueue_head(&dev->rd_wq);
+    atomic_set(&dev->wr_excl, 0);
+    atomic_set(&dev->rd_excl, 0);
+    mutex_init(&dev->ctl_lock);
+    mutex_init(&dev->rd_lock);
+    INIT_LIST_HEAD(&dev->readers);
+    hrtimer_setup(&dev->flush_timer, pchar_flush_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    INIT_WORK(&dev->fwd_work, pchar_fwd_work);
+}
+
+// counterpart of pchar_dev_init() + pchar_alloc_queues()
+static void pchar_dev_free(pchar_device_t *dev)
+{
+    hrtimer_cancel(&dev->flush_timer);
+    cancel_work_sync(&dev->fwd_work);
+    vfree(dev->ring);
+    pchar_free_queues(dev);
+    mutex_destroy(&dev->rd_lock);
+    mutex_destroy(&dev->ctl_lock);
+    kfree(dev);
+}
+
+// last reference gone (destroyed and last open file closed) -- free everything
+static void pchar_dev_release(struct device *d)
+{
+    pchar_dev_free(container_of(d, pchar_device_t, device));
+}
+
+// create instance /dev/<name> with size byte buffer(s) on NUMA node (NUMA_NO_NODE: any),
+// with nlanes priority lanes (0: none). called with pchar_devs_lock held
+static pchar_device_t *pchar_dev_create(const char *name, unsigned int size, int node, unsigned int nlanes)
+{
+    pchar_device_t *dev;
+    unsigned long idx;
+    u32 minor;
+    int ret;
+
+    if (size > BUF_MAX || nlanes > FIFO_LANES_MAX)
+        return ERR_PTR(-EINVAL);
+    if (node != NUMA_NO_NODE && (node < 0 || node >= nr_node_ids || !node_online(node)))
+        return ERR_PTR(-EINVAL);
+    xa_for_each(&pchar_devs, idx, dev)
+    {
+        if (strcmp(dev_name(&dev->device), name) == 0)
+            return ERR_PTR(-EEXIST);
+    }
+
+    dev = kzalloc_node(sizeof(pchar_device_t), GFP_KERNEL, node);
+    if (dev == NULL)
+        return ERR_PTR(-ENOMEM);
+    pchar_dev_init(dev, node);
+    // from here on the struct device owns dev -- errors just put_device()
+    device_initialize(&dev->device);
+    dev->device.class = pclass;
+    dev->device.groups = pchar_groups;
+    dev->device.release = pchar_dev_release;
+
+    // device buffers -- kfifos (one per lane, or per CPU when sharded) and counters
+    if (nlanes > 1)
+        dev->nlanes = nlanes;
+    ret = pchar_alloc_queues(dev, dev->nlanes ? dev->nlanes : (sharded ? nr_cpu_ids : 1), size ? size : MAX);
+    if (ret < 0)
+        goto put_dev;
+    ret = xa_alloc(&pchar_devs, &minor, dev, XA_LIMIT(0, PCHAR_MINORS - 1), GFP_KERNEL);
+    if (ret < 0)
+        goto put_dev;
+    dev->device.devt = MKDEV(major, minor);
+    ret = dev_set_name(&dev->device, "%s", name);
+    if (ret < 0)
+        goto xa_erase;
+    // cdev holds a device reference for every open file
+    cdev_init(&dev->cdev, &pchar_fops);
+    dev->cdev.owner = THIS_MODULE;
+    ret = cdev_device_add(&dev->cdev, &dev->device);
+    if (ret < 0)
+        goto xa_erase;
+
+    // debugfs -- per device counters in pchar/<name>/stats (failures are not fatal)
+    dev->dbg_dir = debugfs_create_dir(name, pchar_dbg_root);
+    debugfs_create_file("stats", 0444, dev->dbg_dir, dev, &pchar_stats_fops);
+    return dev;
+
+xa_erase:
+    xa_erase(&pchar_devs, minor);
+put_dev:
+    put_device(&dev->device);
+    return ERR_PTR(ret);
+}
+
+// FIFO_LINK -- stop forwarding from src, called with pchar_devs_lock held
+static void pchar_unlink(pchar_device_t *src)
+{
+    pchar_device_t *dst = src->link;
+
+    if (dst == NULL)
+        return;
+    mutex_lock(&src->ctl_lock);
+    WRITE_ONCE(src->link, NULL);
+    mutex_unlock(&src->ctl_lock);
+    // the forwarding work may wait for room in dst
+    wake_up_interruptible_all(&dst->wr_wq);
+    cancel_work_sync(&src->fwd_work);
+    mutex_lock(&dst->ctl_lock);
+    dst->linked = false;
+    mutex_unlock(&dst->ctl_lock);
+    put_device(&dst->device);
+}
+
+// FIFO_LINK -- forward src into the device open on fd (< 0: unlink), called
+// with pchar_devs_lock held, which also keeps the chains stable
+static int pchar_link(pchar_device_t *src, int fd)
+{
+    pchar_device_t *dst, *d;
+    struct fd f;
+    int ret = 0;
+
+    if (fd < 0)
+    {
+        pchar_unlink(src);
+        return 0;
+    }
+    // like splice() -- only who may write to dst can feed it. The open file
+    // also keeps dst from being destroyed while we look at it.
+    f = fdget(fd);
+    if (fd_file(f) == NULL)
+        return -EBADF;
+    if (!(fd_file(f)->f_mode & FMODE_WRITE))
+    {
+        ret = -EBADF;
+        goto out_put;
+    }
+    if (fd_file(f)->f_op != &pchar_fops)
+    {
+        ret = -EINVAL;
+        goto out_put;
+    }
+    dst = ((pchar_file_t *)fd_file(f)->private_data)->dev;
+    if (src->link != NULL || dst->linked)
+    {
+        ret = -EBUSY;
+        goto out_put;
+    }
+    // a loop would move the same data round forever
+    for (d = dst; d != NULL; d = d->link)
+    {
+        if (d == src)
+        {
+            ret = -ELOOP;
+            goto out_put;
+        }
+    }
+    mutex_lock(&src->ctl_lock);
+    mutex_lock_nested(&dst->ctl_lock, SINGLE_DEPTH_NESTING);
+    // an overwrite source could drop the head the forwarding work is copying
+    if (src->nqueues > 1 || dst->nqueues > 1 || src->ring != NULL || dst->ring != NULL ||
+        src->bcast != FIFO_BCAST_OFF || dst->bcast != FIFO_BCAST_OFF || src->overwrite || src->dead || dst->dead)
+        ret = -EINVAL;
+    else
+    {
+        get_device(&dst->device); // released by pchar_unlink()
+        dst->linked = true;
+        WRITE_ONCE(src->link, dst);
+    }
+    mutex_unlock(&dst->ctl_lock);
+    mutex_unlock(&src->ctl_lock);
+    // forward what is queued already
+    if (ret == 0)
+        queue_work(pchar_fwd_wq, &src->fwd_work);
+out_put:
+    fdput(f);
+    return ret;
+}
+
+// destroy an instance, called with pchar_devs_lock held. An open device is
+// busy; the memory goes away with the last reference (see pchar_dev_release).
+static int pchar_dev_destroy(pchar_device_t *dev)
+{
+    mutex_lock(&dev->ctl_lock);
+    // open, or fed by another device (unlink that one first)
+    if (dev->users > 0 || dev->linked)
+    {
+        mutex_unlock(&dev->ctl_lock);
+        return -EBUSY;
+    }
+    dev->dead = true;
+    mutex_unlock(&dev->ctl_lock);
+    pchar_unlink(dev);
+    debugfs_remove_recursive(dev->dbg_dir);
+    cdev_device_del(&dev->cdev, &dev->device);
+    xa_erase(&pchar_devs, MINOR(dev->device.devt));
+    put_device(&dev->device);
+    return 0;
+}
+
+static void pchar_dev_destroy_all(void)
+{
+    pchar_device_t *dev;
+    unsigned long idx;
+    mutex_lock(&pchar_devs_lock);
+    // no open files while the module is being unloaded -- nothing is busy
+    // once the chains are taken apart
+    xa_for_each(&pchar_devs, idx, dev)
+        pchar_unlink(dev);
+    xa_for_each(&pchar_devs, idx, dev)
+    {
+        pchar_dev_destroy(dev);
+        pr_info("%s: destroyed device instance %lu.\n", THIS_MODULE->name, idx);
+    }
+    mutex_unlock(&pchar_devs_lock);
+}
 
 static int __init pchar_init(void)
 {
     int ret, i;
-    struct device *pdevice;
+    pchar_device_t *dev;
 
     pr_info("%s: pchar_init() called.\n", THIS_MODULE->name);
-    // allocate devices private struct dynamic array
-    devices = (pchar_device_t *)kmalloc(devcnt * sizeof(pchar_device_t), GFP_KERNEL);
-    if (devices == NULL)
+    if (devcnt < 0 || devcnt > PCHAR_MINORS)
     {
-        ret = -ENOMEM;
-        pr_err("%s: kmalloc() failed.\n", THIS_MODULE->name);
-        goto kmalloc_failed;
+        pr_err("%s: devcnt must be 0...%d.\n", THIS_MODULE->name, PCHAR_MINORS);
+        return -EINVAL;
+    }
+    if (lanes > FIFO_LANES_MAX || (lanes > 1 && sharded))
+    {
+        pr_err("%s: lanes must be 0...%d, and not with sharded.\n", THIS_MODULE->name, FIFO_LANES_MAX);
+        return -EINVAL;
     }
-    pr_info("%s: kmalloc() allocated private struct for %d devices.\n", THIS_MODULE->name, devcnt);
 
-    // allocate device number
-    ret = alloc_chrdev_region(&devno, 0, devcnt, "pchar");
+    // allocate device numbers -- for the load time devices and the ones created later
+    ret = alloc_chrdev_region(&devno, 0, PCHAR_MINORS, "pchar");
     if (ret < 0)
     {
         pr_err("%s: alloc_chrdev_region() failed.\n", THIS_MODULE->name);
@@ -71,7 +600,7 @@ static int __init pchar_init(void)
     }
     major = MAJOR(devno);
     pr_info("%s: alloc_chrdev_region() allocated device num for %d devices from %d/%d.\n",
-            THIS_MODULE->name, devcnt, major, MINOR(devno));
+            THIS_MODULE->name, PCHAR_MINORS, major, MINOR(devno));
 
     // create device class
     pclass = class_create("pchar_class");
@@ -83,193 +612,2015 @@ static int __init pchar_init(void)
     }
     pr_info("%s: class_create() created pchar device class.\n", THIS_MODULE->name);
 
-    // create device files
-    for (i = 0; i < devcnt; i++)
+    // FIFO_LINK forwarding work
+    pchar_fwd_wq = alloc_workqueue("pchar_fwd", WQ_UNBOUND, 0);
+    if (pchar_fwd_wq == NULL)
     {
-        dev_t devnum = MKDEV(major, i);
-        pdevice = device_create(pclass, NULL, devnum, NULL, "pchar%d", i);
-        if (IS_ERR(pdevice))
-        {
-            ret = -1;
-            pr_err("%s: device_create() failed to created device file pchar%d.\n", THIS_MODULE->name, i);
-            goto device_create_failed;
-        }
-        pr_info("%s: device_create() created device file pchar%d.\n", THIS_MODULE->name, i);
+        ret = -ENOMEM;
+        pr_err("%s: alloc_workqueue() failed.\n", THIS_MODULE->name);
+        goto alloc_workqueue_failed;
     }
 
-    // init cdev for each device and add it in kernel
-    for (i = 0; i < devcnt; i++)
-    {
-        dev_t devnum = MKDEV(major, i);
-        cdev_init(&devices[i].cdev, &pchar_fops);
-        ret = cdev_add(&devices[i].cdev, devnum, 1);
-        if (ret < 0)
-        {
-            pr_err("%s: cdev_add() failed for pchar%d.\n", THIS_MODULE->name, i);
-            goto cdev_add_failed;
-        }
-        pr_info("%s: cdev_add() added pchar%d cdev in kernel.\n", THIS_MODULE->name, i);
-    }
+    // debugfs root -- per device directories are added by pchar_dev_create()
+    pchar_dbg_root = debugfs_create_dir("pchar", NULL);
 
-    // alloc device buffers -- kfifos
+    // create the load time devices pchar0...
     for (i = 0; i < devcnt; i++)
     {
-        ret = kfifo_alloc(&devices[i].buffer, MAX, GFP_KERNEL);
-        if (ret < 0)
+        char name[16];
+        unsigned int size = (i < nbufsize) ? bufsize[i] : 0;
+        int node = (i < nnuma_node) ? numa_node[i] : NUMA_NO_NODE;
+        snprintf(name, sizeof(name), "pchar%d", i);
+        mutex_lock(&pchar_devs_lock);
+        dev = pchar_dev_create(name, size, node, lanes);
+        mutex_unlock(&pchar_devs_lock);
+        if (IS_ERR(dev))
         {
-            pr_err("%s: kfifo_alloc() failed for pchar%d buffer.\n", THIS_MODULE->name, i);
-            goto kfifo_alloc_failed;
+            ret = PTR_ERR(dev);
+            pr_err("%s: pchar_dev_create() failed for %s (%d).\n", THIS_MODULE->name, name, ret);
+            goto dev_create_failed;
         }
-        pr_info("%s: kfifo_alloc() allocated buffer for pchar%d.\n", THIS_MODULE->name, i);
+        pr_info("%s: pchar_dev_create() created device file %s (%u byte buffer).\n",
+                THIS_MODULE->name, name, kfifo_size(&dev->queues[0].fifo));
     }
 
-    // initialize waiting queues
-    for (i = 0; i < devcnt; i++)
-    {
-        init_waitqueue_head(&devices[i].wr_wq);
-        pr_info("%s: init_waitqueue_head() initialized waiting queue for pchar%d.\n", THIS_MODULE->name, i);
-    }
-    for (i = 0; i < devcnt; i++)
+    // control node
+    ret = misc_register(&pchar_ctl_misc);
+    if (ret < 0)
     {
-        init_waitqueue_head(&devices[i].rd_wq);
-        pr_info("%s: init_waitqueue_head() initialized waiting queue for pchar%d.\n", THIS_MODULE->name, i);
+        pr_err("%s: misc_register() failed for pchar_ctl.\n", THIS_MODULE->name);
+        goto dev_create_failed;
     }
+    pr_info("%s: misc_register() created device file pchar_ctl.\n", THIS_MODULE->name);
 
     return 0;
 
-kfifo_alloc_failed:
-    for (i = i - 1; i >= 0; i--)
-        kfifo_free(&devices[i].buffer);
-    i = devcnt;
-cdev_add_failed:
-    for (i = i - 1; i >= 0; i--)
-        cdev_del(&devices[i].cdev);
-    i = devcnt;
-device_create_failed:
-    for (i = i - 1; i >= 0; i--)
-    {
-        dev_t devnum = MKDEV(major, i);
-        device_destroy(pclass, devnum);
-    }
+dev_create_failed:
+    pchar_dev_destroy_all();
+    debugfs_remove_recursive(pchar_dbg_root);
+    destroy_workqueue(pchar_fwd_wq);
+alloc_workqueue_failed:
     class_destroy(pclass);
 class_create_failed:
-    unregister_chrdev_region(devno, devcnt);
+    unregister_chrdev_region(devno, PCHAR_MINORS);
 alloc_chrdev_region_failed:
-    kfree(devices);
-kmalloc_failed:
     return ret;
 }
 
 static void __exit pchar_exit(void)
 {
-    int i;
     pr_info("%s: pchar_exit() called.\n", THIS_MODULE->name);
-    // dealloc device buffers
-    for (i = devcnt - 1; i >= 0; i--)
-    {
-        kfifo_free(&devices[i].buffer);
-        pr_info("%s: kfifo_free() released device buffers pchar%d.\n", THIS_MODULE->name, i);
-    }
-
-    // delete cdev from kernel
-    for (i = devcnt - 1; i >= 0; i--)
-    {
-        cdev_del(&devices[i].cdev);
-        pr_info("%s: cdev_del() deleted pchar%d cdev from kernel.\n", THIS_MODULE->name, i);
-    }
+    // no new instances
+    misc_deregister(&pchar_ctl_misc);
 
-    // destroy device files
-    for (i = devcnt - 1; i >= 0; i--)
-    {
-        dev_t devnum = MKDEV(major, i);
-        device_destroy(pclass, devnum);
-        pr_info("%s: device_destroy() destroyed device file pchar%d.\n", THIS_MODULE->name, i);
-    }
+    // destroy device files and release device buffers
+    pchar_dev_destroy_all();
+    debugfs_remove_recursive(pchar_dbg_root);
+    xa_destroy(&pchar_devs);
+    destroy_workqueue(pchar_fwd_wq);
 
     // destroy device class
     class_destroy(pclass);
     pr_info("%s: class_destroy() destroyed device class.\n", THIS_MODULE->name);
 
     // release device number
-    unregister_chrdev_region(devno, devcnt);
+    unregister_chrdev_region(devno, PCHAR_MINORS);
     pr_info("%s: unregister_chrdev_region() released device numbers.\n", THIS_MODULE->name);
-
-    // release devices private struct dynamic array
-    kfree(devices);
-    pr_info("%s: kfree() released private struct for %d devices.\n", THIS_MODULE->name, devcnt);
 }
 
 static int pchar_open(struct inode *pinode, struct file *pfile)
 {
-    pfile->private_data = container_of(pinode->i_cdev, pchar_device_t, cdev);
-    pr_info("%s: pchar_open() called.\n", THIS_MODULE->name);
+    pchar_device_t *dev = container_of(pinode->i_cdev, pchar_device_t, cdev);
+    pchar_file_t *pf;
+    int ret = 0;
+    pf = kmalloc(sizeof(pchar_file_t), GFP_KERNEL);
+    if (pf == NULL)
+        return -ENOMEM;
+    mutex_lock(&dev->ctl_lock);
+    // raced with PCHAR_CTL_DESTROY
+    if (dev->dead)
+        ret = -ENODEV;
+    else
+        dev->users++;
+    mutex_unlock(&dev->ctl_lock);
+    if (ret != 0)
+    {
+        kfree(pf);
+        return ret;
+    }
+    pf->dev = dev;
+    // sharded: bind the producer to the queue of the current CPU. binding per file
+    // (not per write) keeps a producer's bytes in order even if it migrates later.
+    // lanes: writers start out on the lowest lane
+    pf->txq = &dev->queues[dev->nqueues > 1 && !dev->nlanes ? raw_smp_processor_id() % dev->nqueues : 0];
+    INIT_LIST_HEAD(&pf->rd_node);
+    pf->lagged = false;
+    if (pfile->f_mode & FMODE_READ)
+    {
+        // a broadcast reader starts at the end of the data
+        mutex_lock(&dev->rd_lock);
+        pf->rd_pos = smp_load_acquire(&dev->queues[0].fifo.kfifo.in);
+        list_add_tail(&pf->rd_node, &dev->readers);
+        mutex_unlock(&dev->rd_lock);
+    }
+    pfile->private_data = pf;
+    // read/write honor IOCB_NOWAIT -- let io_uring issue them inline
+    pfile->f_mode |= FMODE_NOWAIT;
+    pchar_dbg("pchar_open() called.\n");
     return 0;
 }
 
 static int pchar_close(struct inode *pinode, struct file *pfile)
 {
-    pr_info("%s: pchar_close() called.\n", THIS_MODULE->name);
+    pchar_file_t *pf = (pchar_file_t *)pfile->private_data;
+    pchar_device_t *dev = pf->dev;
+    bool freed = false;
+    // remove this file from the async notification list (if it was added)
+    pchar_fasync(-1, pfile, 0);
+    if (!list_empty(&pf->rd_node))
+    {
+        // a broadcast reader leaving may be the one holding space
+        mutex_lock(&dev->rd_lock);
+        list_del(&pf->rd_node);
+        if (dev->bcast)
+            freed = pchar_bcast_reclaim(dev);
+        mutex_unlock(&dev->rd_lock);
+        if (freed)
+            pchar_notify_writers(dev);
+    }
+    mutex_lock(&pf->dev->ctl_lock);
+    pf->dev->users--;
+    mutex_unlock(&pf->dev->ctl_lock);
+    kfree(pf);
+    pchar_dbg("pchar_close() called.\n");
     return 0;
 }
 
-static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset)
+// bump one per-CPU counter of dev. The flush timer counts wakeups from
+// softirq context, so an update must not be interrupted half way (this only
+// costs anything where u64_stats has a seqcount, i.e. 32-bit SMP).
+#define pchar_stat_add(dev, field, n)                           \
+    do                                                          \
+    {                                                           \
+        pchar_stats_t *__st = get_cpu_ptr((dev)->stats);        \
+        unsigned long __fl = u64_stats_update_begin_irqsave(&__st->syncp); \
+        u64_stats_add(&__st->field, (n));                       \
+        u64_stats_update_end_irqrestore(&__st->syncp, __fl);    \
+        put_cpu_ptr((dev)->stats);                              \
+    } while (0)
+
+// account nbytes enqueued into q by one write op -- called with q->wr_lock held
+static void pchar_account_in(pchar_device_t *dev, pchar_queue_t *q, size_t nbytes)
 {
-    pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
-    int nbytes, ret;
-    pr_info("%s: pchar_write() called.\n", THIS_MODULE->name);
-    // if buffer is full, block the writer process
-    // the process will wake up when given cond is true i.e. kfifo is not full
-    ret = wait_event_interruptible(dev->wr_wq, !kfifo_is_full(&dev->buffer));
-    // process will wakeup when space is avail in buffer due to reading -- ret == 0
-    // process will wakeup due to signal -- ret == ERESTARTSYS
-    if (ret != 0)
+    pchar_stats_t *st;
+    unsigned int len = kfifo_len(&q->fifo), old;
+    unsigned long flags;
+
+    trace_pchar_enqueue(dev_name(&dev->device), nbytes, len);
+    st = get_cpu_ptr(dev->stats);
+    flags = u64_stats_update_begin_irqsave(&st->syncp); // see pchar_stat_add()
+    u64_stats_add(&st->bytes_in, nbytes);
+    u64_stats_inc(&st->writes);
+    u64_stats_update_end_irqrestore(&st->syncp, flags);
+    put_cpu_ptr(dev->stats);
+    // lock-free max -- only writes when a new high-water mark is reached
+    old = READ_ONCE(dev->high_water);
+    while (len > old)
     {
-        pr_info("%s: process wakeup due to signal.\n", THIS_MODULE->name);
-        return -ERESTARTSYS; // restart the syscall i.e. write()
+        unsigned int prev = cmpxchg(&dev->high_water, old, len);
+        if (prev == old)
+            break;
+        old = prev;
     }
-    ret = kfifo_from_user(&dev->buffer, ubuf, ubufsize, &nbytes);
-    if (ret < 0)
+}
+
+// sum up the per-CPU counters and buffer state of dev
+static void pchar_get_stats(pchar_device_t *dev, struct fifo_stats *fs)
+{
+    unsigned int i, start;
+    int cpu;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->version = FIFO_STATS_VERSION;
+    for (i = 0; i < dev->nqueues; i++)
     {
-        pr_err("%s: kfifo_from_user() failed.\n", THIS_MODULE->name);
-        return ret;
+        fs->size += kfifo_size(&dev->queues[i].fifo);
+        fs->length += kfifo_len(&dev->queues[i].fifo);
     }
-    if (nbytes > 0)
+    fs->avail = fs->size - fs->length;
+    fs->high_water = READ_ONCE(dev->high_water);
+    for_each_possible_cpu(cpu)
     {
-        wake_up_interruptible(&dev->rd_wq);
-        pr_info("%s: the blocked writer process is woken up.\n", THIS_MODULE->name);
+        const pchar_stats_t *st = per_cpu_ptr(dev->stats, cpu);
+        u64 bytes_in, bytes_out, writes, reads, wr_blocked, rd_blocked, drops, errors, wakeups, avoided;
+        do
+        {
+            start = u64_stats_fetch_begin(&st->syncp);
+            bytes_in = u64_stats_read(&st->bytes_in);
+            bytes_out = u64_stats_read(&st->bytes_out);
+            writes = u64_stats_read(&st->writes);
+            reads = u64_stats_read(&st->reads);
+            wr_blocked = u64_stats_read(&st->wr_blocked);
+            rd_blocked = u64_stats_read(&st->rd_blocked);
+            drops = u64_stats_read(&st->drops);
+            errors = u64_stats_read(&st->errors);
+            wakeups = u64_stats_read(&st->wakeups);
+            avoided = u64_stats_read(&st->wakeups_avoided);
+        } while (u64_stats_fetch_retry(&st->syncp, start));
+        fs->bytes_in += bytes_in;
+        fs->bytes_out += bytes_out;
+        fs->writes += writes;
+        fs->reads += reads;
+        fs->wr_blocked += wr_blocked;
+        fs->rd_blocked += rd_blocked;
+        fs->drops += drops;
+        fs->errors += errors;
+        fs->wakeups += wakeups;
+        fs->wakeups_avoided += avoided;
     }
-    return nbytes;
 }
 
-static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset)
+// debugfs pchar/pcharN/stats
+static int pchar_stats_show(struct seq_file *m, void *v)
 {
-    pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
-    int nbytes, ret;
-    pr_info("%s: pchar_read() called.\n", THIS_MODULE->name);
-    ret = wait_event_interruptible(dev->rd_wq, !kfifo_is_empty(&dev->buffer));
-    if (ret != 0)
+    pchar_device_t *dev = m->private;
+    struct fifo_stats fs;
+
+    pchar_get_stats(dev, &fs);
+    seq_printf(m, "size: %llu\nlength: %llu\navail: %llu\nhigh_water: %llu\n",
+               fs.size, fs.length, fs.avail, fs.high_water);
+    seq_printf(m, "bytes_in: %llu\nbytes_out: %llu\nwrites: %llu\nreads: %llu\n",
+               fs.bytes_in, fs.bytes_out, fs.writes, fs.reads);
+    seq_printf(m, "wr_blocked: %llu\nrd_blocked: %llu\ndrops: %llu\nerrors: %llu\n",
+               fs.wr_blocked, fs.rd_blocked, fs.drops, fs.errors);
+    seq_printf(m, "wakeups: %llu\nwakeups_avoided: %llu\n", fs.wakeups, fs.wakeups_avoided);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pchar_stats);
+
+// wake all pollers and non-exclusive sleepers on wq, but only one exclusive
+// sleeper -- blocked readers/writers that wait for the same condition sleep
+// exclusively, so one transfer does not wake a whole herd of them. The woken
+// one passes the wakeup on if it leaves data/space behind.
+static bool pchar_wake_one(pchar_device_t *dev, wait_queue_head_t *wq, bool writer, __poll_t key)
+{
+    if (!wq_has_sleeper(wq))
+        return false;
+    pchar_stat_add(dev, wakeups, 1);
+    // other exclusive sleepers stay asleep -- count the wakeup, not the sleepers,
+    // since a passed on wakeup would count the same ones again
+    if (atomic_read(writer ? &dev->wr_excl : &dev->rd_excl) > 1)
+        pchar_stat_add(dev, wakeups_avoided, 1);
+    trace_pchar_wake(dev_name(&dev->device), writer);
+    wake_up_interruptible_poll(wq, key);
+    return true;
+}
+
+// data was added -- wakeup blocked reader process (if any) and SIGIO subscribers.
+// wake only if someone sleeps on rd_wq; the EPOLLIN key keeps EPOLLOUT-only
+// pollers (also hooked on rd_wq via pchar_poll) from seeing spurious readiness.
+static void pchar_wake_readers(pchar_device_t *dev)
+{
+    if (pchar_wake_one(dev, &dev->rd_wq, false, EPOLLIN | EPOLLRDNORM))
+        pchar_dbg("the blocked reader process is woken up.\n");
+    kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+// space was freed -- wakeup blocked writer process (if any) and SIGIO subscribers.
+static void pchar_wake_writers(pchar_device_t *dev)
+{
+    if (pchar_wake_one(dev, &dev->wr_wq, true, EPOLLOUT | EPOLLWRNORM))
+        pchar_dbg("the blocked writer process is woken up.\n");
+    kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
+}
+
+// wakeup moderation (FIFO_SET_WATERMARK): data paths wake the other side only
+// once a watermark is crossed. A held back wakeup is owed -- it is delivered by
+// the flush timer, or right away when a writer/reader is about to block, so
+// both sides can never sleep waiting on each other.
+static void pchar_flush_wakeups(pchar_device_t *dev)
+{
+    if (test_and_clear_bit(PCHAR_PEND_RD, &dev->wake_pending))
+        pchar_wake_readers(dev);
+    if (test_and_clear_bit(PCHAR_PEND_WR, &dev->wake_pending))
+        pchar_wake_writers(dev);
+}
+
+static enum hrtimer_restart pchar_flush_timer(struct hrtimer *timer)
+{
+    pchar_device_t *dev = container_of(timer, pchar_device_t, flush_timer);
+    pchar_flush_wakeups(dev);
+    return HRTIMER_NORESTART;
+}
+
+// hold back a wakeup, arming the flush deadline if one is set
+static void pchar_hold_wakeup(pchar_device_t *dev, int bit)
+{
+    u64 ns = READ_ONCE(dev->flush_ns);
+    if (!test_bit(bit, &dev->wake_pending))
+        set_bit(bit, &dev->wake_pending);
+    if (ns != 0 && !hrtimer_is_queued(&dev->flush_timer))
+        hrtimer_start(&dev->flush_timer, ns_to_ktime(ns), HRTIMER_MODE_REL_SOFT);
+}
+
+// kfifo has no iov_iter interface -- copy the (up to two) contiguous regions
+// directly, the same way kfifo_from_user() does. Copies len bytes into the free
+// space of kf, skip bytes past the in index, without publishing them yet.
+// Returns bytes copied (short on a fault).
+static size_t pchar_copy_from_iter(struct __kfifo *kf, unsigned int skip, struct iov_iter *from, size_t len)
+{
+    unsigned int size = kf->mask + 1;
+    unsigned int off = (kf->in + skip) & kf->mask;
+    size_t l = min_t(size_t, len, size - off), copied;
+
+    copied = copy_from_iter((unsigned char *)kf->data + off, l, from);
+    if (copied == l && len > l)
+        copied += copy_from_iter(kf->data, len - l, from);
+    return copied;
+}
+
+// counterpart of pchar_copy_from_iter() -- copy len queued bytes from kfifo
+// index pos on into an iter without releasing them
+static size_t pchar_copy_to_iter(struct __kfifo *kf, unsigned int pos, struct iov_iter *to, size_t len)
+{
+    unsigned int size = kf->mask + 1;
+    unsigned int off = pos & kf->mask;
+    size_t l = min_t(size_t, len, size - off), copied;
+
+    copied = copy_to_iter((unsigned char *)kf->data + off, l, to);
+    if (copied == l && len > l)
+        copied += copy_to_iter(kf->data, len - l, to);
+    return copied;
+}
+
+// copy up to len bytes into the fifo and publish them. Returns bytes copied.
+static size_t pchar_fifo_from_iter(struct kfifo *fifo, struct iov_iter *from, size_t len)
+{
+    struct __kfifo *kf = &fifo->kfifo;
+    size_t copied;
+
+    len = min_t(size_t, len, kf->mask + 1 - (kf->in - kf->out));
+    copied = pchar_copy_from_iter(kf, 0, from, len);
+    smp_wmb(); // data must be visible before the new in index
+    kf->in += copied;
+    return copied;
+}
+
+// FIFO_SET_OVERWRITE writers drop the head of a queue without rd_lock (see
+// pchar_overwrite_make_room()), so a reader copies from the out index it
+// loaded and then checks that out has not moved: pchar_head_kept() for a copy
+// it keeps queued, pchar_release() for one it takes. false -- the copy may be
+// torn, start over.
+static inline bool pchar_head_kept(struct __kfifo *kf, unsigned int out)
+{
+    smp_rmb(); // the copy, then the check
+    return READ_ONCE(kf->out) == out;
+}
+
+static inline bool pchar_release(struct __kfifo *kf, unsigned int out, unsigned int n)
+{
+    // fully ordered -- data must be copied out before the slot is released
+    return cmpxchg(&kf->out, out, out + n) == out;
+}
+
+// counterpart of pchar_fifo_from_iter(), like kfifo_to_user(). returns bytes
+// copied (0 on a fault), or -ENODATA if an overwrite writer emptied the fifo.
+static ssize_t pchar_fifo_to_iter(struct kfifo *fifo, struct iov_iter *to, size_t len)
+{
+    struct __kfifo *kf = &fifo->kfifo;
+    unsigned int out, n;
+    size_t copied;
+
+    for (;;)
     {
-        pr_info("%s: process wakeup due to signal.\n", THIS_MODULE->name);
-        return -ERESTARTSYS; // restart the syscall i.e. read()
+        out = READ_ONCE(kf->out);
+        n = min_t(size_t, len, smp_load_acquire(&kf->in) - out);
+        if (n == 0)
+            return -ENODATA;
+        copied = pchar_copy_to_iter(kf, out, to, n);
+        if (pchar_release(kf, out, copied))
+            return copied;
+        iov_iter_revert(to, copied);
     }
-    ret = kfifo_to_user(&dev->buffer, ubuf, ubufsize, &nbytes);
-    if (ret < 0)
+}
+
+// record mode: queue all len bytes of from as one record, called with wr_lock
+// held and room checked. returns len, or 0 on a fault (nothing is queued then).
+static size_t pchar_rec_from_iter(struct kfifo *fifo, struct iov_iter *from, size_t len)
+{
+    u32 hdr = len;
+    struct kvec kv = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    struct iov_iter hiter;
+
+    if (pchar_copy_from_iter(&fifo->kfifo, PCHAR_REC_HDR, from, len) < len)
+        return 0;
+    iov_iter_kvec(&hiter, ITER_SOURCE, &kv, 1, sizeof(hdr));
+    pchar_copy_from_iter(&fifo->kfifo, 0, &hiter, sizeof(hdr));
+    smp_wmb(); // header and payload become visible together
+    fifo->kfifo.in += PCHAR_REC_HDR + len;
+    return len;
+}
+
+// byte mode counterpart of pchar_rec_from_iter() for FIFO_WRITE_BATCH: queue
+// all len bytes of from or none, called with wr_lock held and room checked.
+// returns len, or 0 on a fault (nothing is queued then).
+static size_t pchar_msg_from_iter(struct kfifo *fifo, struct iov_iter *from, size_t len)
+{
+    if (pchar_copy_from_iter(&fifo->kfifo, 0, from, len) < len)
+        return 0;
+    smp_wmb(); // the whole message becomes visible at once
+    fifo->kfifo.in += len;
+    return len;
+}
+
+// all device queues empty?
+static bool pchar_is_empty(pchar_device_t *dev)
+{
+    unsigned int i;
+    for (i = 0; i < dev->nqueues; i++)
     {
-        pr_err("%s: kfifo_to_user() failed.\n", THIS_MODULE->name);
-        return ret;
+        if (!kfifo_is_empty(&dev->queues[i].fifo))
+            return false;
+    }
+    return true;
+}
+
+// bytes queued on the device (all queues)
+static unsigned int pchar_len(pchar_device_t *dev)
+{
+    unsigned int i, len = 0;
+    for (i = 0; i < dev->nqueues; i++)
+        len += kfifo_len(&dev->queues[i].fifo);
+    return len;
+}
+
+// most bytes free in any device queue
+static unsigned int pchar_max_avail(pchar_device_t *dev)
+{
+    unsigned int i, avail = 0;
+    for (i = 0; i < dev->nqueues; i++)
+        avail = max(avail, kfifo_avail(&dev->queues[i].fifo));
+    return avail;
+}
+
+// data was added -- wake readers once rd_wmark bytes are queued
+// (capped at the buffer size, which a full queue always reaches)
+static void pchar_notify_readers(pchar_device_t *dev)
+{
+    unsigned int wmark = READ_ONCE(dev->rd_wmark);
+    // chained -- the forwarding work is a reader too, never held back
+    if (READ_ONCE(dev->link) != NULL)
+        queue_work(pchar_fwd_wq, &dev->fwd_work);
+    if (wmark > 1 && pchar_len(dev) < min(wmark, kfifo_size(&dev->queues[0].fifo)))
+    {
+        pchar_hold_wakeup(dev, PCHAR_PEND_RD);
+        return;
     }
-    // after reading a few bytes, wakeup blocked writer process (if any)
-    if (nbytes > 0)
+    if (wmark > 1)
+        clear_bit(PCHAR_PEND_RD, &dev->wake_pending);
+    pchar_wake_readers(dev);
+}
+
+// space was freed -- wake writers once wr_wmark bytes are free in some queue
+static void pchar_notify_writers(pchar_device_t *dev)
+{
+    unsigned int wmark = READ_ONCE(dev->wr_wmark);
+    if (wmark > 1 && pchar_max_avail(dev) < min(wmark, kfifo_size(&dev->queues[0].fifo)))
     {
-        wake_up_interruptible(&dev->wr_wq);
-        pr_info("%s: the blocked writer process is woken up.\n", THIS_MODULE->name);
+        pchar_hold_wakeup(dev, PCHAR_PEND_WR);
+        return;
     }
-    return nbytes;
+    if (wmark > 1)
+        clear_bit(PCHAR_PEND_WR, &dev->wake_pending);
+    pchar_wake_writers(dev);
 }
 
-module_init(pchar_init);
-module_exit(pchar_exit);
+// pass an exclusive wakeup on to the next blocked writer/reader if space/data
+// is left for it -- after a transfer, or when a woken process bails out.
+// (exclusive writers only exist with a single queue)
+static void pchar_pass_wakeup(pchar_device_t *dev, bool writer)
+{
+    if (writer)
+    {
+        if (atomic_read(&dev->wr_excl) > 0 && !kfifo_is_full(&dev->queues[0].fifo))
+            pchar_wake_one(dev, &dev->wr_wq, true, EPOLLOUT | EPOLLWRNORM);
+    }
+    else if (atomic_read(&dev->rd_excl) > 0 && !pchar_is_empty(dev))
+        pchar_wake_one(dev, &dev->rd_wq, false, EPOLLIN | EPOLLRDNORM);
+}
 
-MODULE_LICENSE("GPL");
-MODULE_AUTHOR("Abhishek Shukla");
-MODULE_DESCRIPTION("MY DEVICE DRIVER");
+// take rd/wr lock -- non-blocking callers only try once and never sleep on the mutex
+static int pchar_lock(struct mutex *lock, bool nowait)
+{
+    if (nowait)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(lock) != 0)
+        return -ERESTARTSYS;
+    return 0;
+}
+
+// writer may proceed -- len bytes are free, or they never will be (queue shrunk)
+static inline bool pchar_wr_ready(pchar_queue_t *q, size_t len)
+{
+    return kfifo_avail(&q->fifo) >= len || kfifo_size(&q->fifo) < len;
+}
+
+// FIFO_SET_OVERWRITE: drop the oldest data of q -- whole records in record
+// mode -- until len bytes are free. called with q->wr_lock held, len fits.
+// An overwrite writer never waits, not even for a reader copying out: out is
+// moved past the dropped units without rd_lock, and a reader that was copying
+// them sees its pchar_release() fail and starts over. Only this writer stores
+// into the fifo, so the headers walked here stay put while readers move out.
+static void pchar_overwrite_make_room(pchar_device_t *dev, pchar_queue_t *q, size_t len)
+{
+    struct __kfifo *kf = &q->fifo.kfifo;
+    unsigned int size = kf->mask + 1, out, drop, units;
+
+    do
+    {
+        out = READ_ONCE(kf->out);
+        drop = units = 0;
+        if (dev->record)
+        {
+            for (; size - (kf->in - (out + drop)) < len; units++)
+                drop += PCHAR_REC_HDR + pchar_rec_len_at(kf, out + drop);
+        }
+        else if (size - (kf->in - out) < len)
+            drop = units = len - (size - (kf->in - out));
+        if (units == 0)
+            return; // a reader made the room meanwhile
+    } while (cmpxchg(&kf->out, out, out + drop) != out);
+    pchar_stat_add(dev, drops, drop);
+    atomic64_add(units, &dev->rd_seq);
+    atomic64_add(units, &dev->lost);
+}
+
+// lock q for writing once at least len bytes are free in it.
+// returns 0 with q->wr_lock held, or -errno.
+static int pchar_wr_begin(pchar_device_t *dev, pchar_queue_t *q, size_t len, bool nowait)
+{
+    // sleep exclusively only if every writer waits for the same thing (a free
+    // byte in the one queue) -- otherwise the one woken could be a writer that
+    // still cannot go while another one could
+    bool excl = len == 1 && dev->nqueues == 1;
+    bool woken = false;
+    int ret;
+    for (;;)
+    {
+        ret = pchar_lock(&q->wr_lock, nowait);
+        if (ret != 0)
+            goto out_pass;
+        if (kfifo_size(&q->fifo) < len)
+        {
+            mutex_unlock(&q->wr_lock);
+            return -EMSGSIZE; // can never fit
+        }
+        if (kfifo_avail(&q->fifo) >= len)
+            return 0;
+        // broadcast -- free what all readers are past (FIFO_BCAST_LAG: drop the oldest)
+        if (READ_ONCE(dev->bcast) && pchar_bcast_make_room(dev, q, len, nowait) == 0 &&
+            kfifo_avail(&q->fifo) >= len)
+            return 0;
+        // overwrite -- never wait, the oldest data goes instead
+        if (READ_ONCE(dev->overwrite))
+        {
+            pchar_overwrite_make_room(dev, q, len);
+            return 0;
+        }
+        mutex_unlock(&q->wr_lock);
+        // non-blocking writer never sleeps -- report "try again" when buffer is full
+        if (nowait)
+            return -EAGAIN;
+        // if buffer is full, block the writer process
+        // the process will wake up when space is avail in buffer due to reading -- ret == 0
+        // process will wakeup due to signal -- ret == ERESTARTSYS
+        // readers must not sit on a held back wakeup while we wait for them
+        pchar_flush_wakeups(dev);
+        trace_pchar_block(dev_name(&dev->device), true);
+        pchar_stat_add(dev, wr_blocked, 1);
+        if (excl)
+        {
+            atomic_inc(&dev->wr_excl);
+            ret = wait_event_interruptible_exclusive(dev->wr_wq, pchar_wr_ready(q, len) ||
+                                                     READ_ONCE(dev->overwrite));
+            atomic_dec(&dev->wr_excl);
+            woken = true;
+        }
+        else
+            ret = wait_event_interruptible(dev->wr_wq, pchar_wr_ready(q, len) || READ_ONCE(dev->overwrite));
+        if (ret != 0)
+        {
+            pchar_dbg("process wakeup due to signal.\n");
+            return -ERESTARTSYS; // restart the syscall i.e. write()
+        }
+    }
+
+out_pass:
+    // bailing out after an exclusive wakeup -- hand it to the next writer
+    if (woken)
+        pchar_pass_wakeup(dev, true);
+    return ret;
+}
+
+// lock q for a write of len bytes in the device's framing mode, returned in *rec.
+// a record needs room for len bytes plus its header. In byte mode a write that
+// may be partial needs only one free byte, otherwise all len bytes.
+// returns 0 with q->wr_lock held, or -errno.
+static int pchar_wr_start(pchar_device_t *dev, pchar_queue_t *q, size_t len, bool partial, bool nowait, bool *rec)
+{
+    int ret;
+    for (;;)
+    {
+        bool r = READ_ONCE(dev->record);
+        size_t need = r ? len + PCHAR_REC_HDR : (partial ? 1 : len);
+        // FIFO_BCAST_LAG and overwrite writers never wait -- make room for as much as fits at once
+        if (!r && partial && (READ_ONCE(dev->bcast) == FIFO_BCAST_LAG || READ_ONCE(dev->overwrite)))
+            need = min_t(size_t, len, kfifo_size(&q->fifo));
+        ret = pchar_wr_begin(dev, q, need, nowait);
+        if (ret != 0)
+            return ret;
+        // FIFO_RING_SETUP switched the device meanwhile -- data here would be stranded
+        if (READ_ONCE(dev->ring_ctrl) != NULL)
+        {
+            mutex_unlock(&q->wr_lock);
+            return -EINVAL;
+        }
+        // mode only changes on an empty device with all locks held -- recheck under ours
+        if (r == dev->record)
+        {
+            *rec = r;
+            return 0;
+        }
+        mutex_unlock(&q->wr_lock);
+    }
+}
+
+// data for reader pf -- any queued data, or (broadcast) data past its cursor
+static inline bool pchar_rd_ready(pchar_device_t *dev, pchar_file_t *pf)
+{
+    if (READ_ONCE(dev->bcast))
+        return READ_ONCE(pf->lagged) ||
+               READ_ONCE(pf->rd_pos) != smp_load_acquire(&dev->queues[0].fifo.kfifo.in);
+    return !pchar_is_empty(dev);
+}
+
+// lock the device for reading once there is data for pf.
+// returns 0 with dev->rd_lock held, or -errno.
+static int pchar_rd_begin(pchar_device_t *dev, pchar_file_t *pf, bool nowait)
+{
+    bool woken = false;
+    int ret;
+    for (;;)
+    {
+        ret = pchar_lock(&dev->rd_lock, nowait);
+        if (ret != 0)
+            goto out_pass;
+        if (pchar_rd_ready(dev, pf))
+            return 0;
+        mutex_unlock(&dev->rd_lock);
+        // non-blocking reader never sleeps -- report "try again" when buffer is empty
+        if (nowait)
+            return -EAGAIN;
+        pchar_flush_wakeups(dev);
+        trace_pchar_block(dev_name(&dev->device), false);
+        pchar_stat_add(dev, rd_blocked, 1);
+        if (READ_ONCE(dev->bcast))
+        {
+            // broadcast readers each wait for their own cursor -- wake them all
+            ret = wait_event_interruptible(dev->rd_wq, pchar_rd_ready(dev, pf));
+        }
+        else
+        {
+            // all readers wait for the same thing -- any data -- so wake-one is enough
+            atomic_inc(&dev->rd_excl);
+            ret = wait_event_interruptible_exclusive(dev->rd_wq, pchar_rd_ready(dev, pf));
+            atomic_dec(&dev->rd_excl);
+            woken = true;
+        }
+        if (ret != 0)
+        {
+            pchar_dbg("process wakeup due to signal.\n");
+            return -ERESTARTSYS; // restart the syscall i.e. read()
+        }
+    }
+
+out_pass:
+    // bailing out after an exclusive wakeup -- hand it to the next reader
+    if (woken)
+        pchar_pass_wakeup(dev, false);
+    return ret;
+}
+
+// pick the queue the next read takes from, called with rd_lock held.
+// returns its index, or -1 if all are empty. Sharded mode goes round-robin
+// from next_rd; with lanes the highest non-empty lane wins, except that after
+// lane_quota reads passing over a waiting lower lane the lowest one gets a turn.
+static int pchar_rd_queue(pchar_device_t *dev)
+{
+    unsigned int i, qi, quota;
+    int hi = -1, lo = -1;
+
+    if (dev->nlanes == 0)
+    {
+        for (i = 0, qi = dev->next_rd; i < dev->nqueues; i++, qi = (qi + 1) % dev->nqueues)
+        {
+            if (!kfifo_is_empty(&dev->queues[qi].fifo))
+                return qi;
+        }
+        return -1;
+    }
+    for (i = 0; i < dev->nlanes; i++)
+    {
+        if (kfifo_is_empty(&dev->queues[i].fifo))
+            continue;
+        if (lo < 0)
+            lo = i;
+        hi = i;
+    }
+    quota = READ_ONCE(dev->lane_quota);
+    if (quota > 0 && dev->lane_streak >= quota)
+        return lo;
+    return hi;
+}
+
+// the read took units bytes (records) from queue qi -- move the sequence number
+// and the round-robin on, or count a read that passed over a waiting lower lane.
+// called with rd_lock held.
+static void pchar_rd_taken(pchar_device_t *dev, unsigned int qi, unsigned int units)
+{
+    unsigned int i;
+
+    atomic64_add(units, &dev->rd_seq);
+    if (dev->nlanes == 0)
+    {
+        dev->next_rd = (qi + 1) % dev->nqueues;
+        return;
+    }
+    for (i = 0; i < qi && kfifo_is_empty(&dev->queues[i].fifo); i++)
+        ;
+    dev->lane_streak = i < qi ? dev->lane_streak + 1 : 0;
+}
+
+// copy up to len bytes out of the device queues, called with rd_lock held.
+// sharded mode drains the queues round-robin starting at next_rd, lanes
+// from the highest down. returns bytes copied, or -errno (-ENODATA: overwrite
+// writers dropped all there was).
+static ssize_t pchar_drain_to_iter(pchar_device_t *dev, struct iov_iter *to, size_t len)
+{
+    size_t nbytes = 0;
+    ssize_t n;
+    int qi;
+
+    while (nbytes < len && (qi = pchar_rd_queue(dev)) >= 0)
+    {
+        struct kfifo *fifo = &dev->queues[qi].fifo;
+        n = pchar_fifo_to_iter(fifo, to, len - nbytes);
+        if (n == -ENODATA)
+            continue; // dropped under us, look again
+        if (n == 0)
+            return nbytes > 0 ? nbytes : -EFAULT;
+        trace_pchar_dequeue(dev_name(&dev->device), n, kfifo_len(fifo));
+        pchar_stat_add(dev, bytes_out, n);
+        pchar_rd_taken(dev, qi, n);
+        nbytes += n;
+    }
+    return nbytes == 0 && len > 0 ? -ENODATA : nbytes;
+}
+
+// record mode: move the next record (in pchar_rd_queue() order) into to,
+// called with rd_lock held. A record never splits: if it is longer than len it
+// stays queued and -EMSGSIZE is returned. returns the record length, or -errno
+// (-ENODATA: overwrite writers dropped all there was).
+static ssize_t pchar_rec_to_iter(pchar_device_t *dev, struct iov_iter *to, size_t len)
+{
+    struct kfifo *fifo;
+    struct __kfifo *kf;
+    unsigned int out;
+    size_t copied;
+    u32 hdr;
+    int qi;
+
+    for (;;)
+    {
+        qi = pchar_rd_queue(dev);
+        if (qi < 0)
+            return -ENODATA;
+        fifo = &dev->queues[qi].fifo;
+        kf = &fifo->kfifo;
+        out = READ_ONCE(kf->out);
+        if (out == smp_load_acquire(&kf->in))
+            continue;
+        hdr = pchar_rec_len_at(kf, out);
+        if (!pchar_head_kept(kf, out))
+            continue; // the header may be torn
+        if (hdr > len)
+            return -EMSGSIZE;
+        copied = pchar_copy_to_iter(kf, out + PCHAR_REC_HDR, to, hdr);
+        if (copied == hdr && pchar_release(kf, out, PCHAR_REC_HDR + hdr))
+            break;
+        iov_iter_revert(to, copied);
+        if (copied < hdr && pchar_head_kept(kf, out))
+            return -EFAULT; // record stays queued
+    }
+    trace_pchar_dequeue(dev_name(&dev->device), hdr, kfifo_len(fifo));
+    pchar_stat_add(dev, bytes_out, hdr);
+    pchar_rd_taken(dev, qi, 1);
+    return hdr;
+}
+
+// broadcast: length of the record whose header starts at kfifo index pos
+static u32 pchar_rec_len_at(struct __kfifo *kf, unsigned int pos)
+{
+    u32 hdr;
+    unsigned char *p = (unsigned char *)&hdr;
+    unsigned int i;
+    for (i = 0; i < sizeof(hdr); i++)
+        p[i] = ((unsigned char *)kf->data)[(pos + i) & kf->mask];
+    return hdr;
+}
+
+// broadcast: free the space every reader is past -- out follows the slowest
+// cursor, or the end of the data when no reader is left. called with rd_lock
+// held, returns true if space was freed.
+static bool pchar_bcast_reclaim(pchar_device_t *dev)
+{
+    struct __kfifo *kf = &dev->queues[0].fifo.kfifo;
+    unsigned int in = smp_load_acquire(&kf->in), tail = in;
+    pchar_file_t *pf;
+
+    list_for_each_entry(pf, &dev->readers, rd_node)
+    {
+        if (in - pf->rd_pos > in - tail)
+            tail = pf->rd_pos;
+    }
+    if (tail == kf->out)
+        return false;
+    smp_wmb(); // data must be copied out before the slot is released
+    kf->out = tail;
+    return true;
+}
+
+// broadcast: make room for len bytes in q before the writer would wait. Frees
+// what all readers are past; with FIFO_BCAST_LAG it drops the oldest data too
+// (whole records in record mode) and marks the readers that missed it lagged.
+// called with q->wr_lock held.
+static int pchar_bcast_make_room(pchar_device_t *dev, pchar_queue_t *q, size_t len, bool nowait)
+{
+    struct __kfifo *kf = &q->fifo.kfifo;
+    unsigned int size = kf->mask + 1, out, dropped;
+    pchar_file_t *pf;
+    int ret;
+
+    ret = pchar_lock(&dev->rd_lock, nowait);
+    if (ret != 0)
+        return ret;
+    if (pchar_bcast_reclaim(dev))
+        pchar_notify_writers(dev);
+    if (kfifo_avail(&q->fifo) < len && dev->bcast == FIFO_BCAST_LAG)
+    {
+        out = kf->out;
+        if (dev->record)
+        {
+            while (size - (kf->in - out) < len)
+                out += PCHAR_REC_HDR + pchar_rec_len_at(kf, out);
+        }
+        else
+            out = kf->in + len - size;
+        dropped = out - kf->out;
+        list_for_each_entry(pf, &dev->readers, rd_node)
+        {
+            if (pf->rd_pos - kf->out < dropped)
+            {
+                WRITE_ONCE(pf->rd_pos, out);
+                WRITE_ONCE(pf->lagged, true);
+            }
+        }
+        kf->out = out;
+        pchar_stat_add(dev, drops, dropped);
+        // lagged readers have news
+        pchar_wake_readers(dev);
+    }
+    mutex_unlock(&dev->rd_lock);
+    return 0;
+}
+
+// broadcast: copy the data at pf's cursor -- up to len bytes, or the next whole
+// record -- and advance the cursor. called with rd_lock held.
+// returns bytes copied, or -errno (EOVERFLOW once after data was dropped).
+static ssize_t pchar_bcast_to_iter(pchar_file_t *pf, struct iov_iter *to, size_t len)
+{
+    pchar_device_t *dev = pf->dev;
+    struct __kfifo *kf = &dev->queues[0].fifo.kfifo;
+    unsigned int avail = smp_load_acquire(&kf->in) - pf->rd_pos;
+    size_t n;
+
+    if (pf->lagged)
+    {
+        // tell the reader once, it goes on with the oldest data still held
+        WRITE_ONCE(pf->lagged, false);
+        return -EOVERFLOW;
+    }
+    if (dev->record)
+    {
+        u32 hdr = pchar_rec_len_at(kf, pf->rd_pos);
+        if (hdr > len)
+            return -EMSGSIZE;
+        if (pchar_copy_to_iter(kf, pf->rd_pos + PCHAR_REC_HDR, to, hdr) < hdr)
+            return -EFAULT;
+        WRITE_ONCE(pf->rd_pos, pf->rd_pos + PCHAR_REC_HDR + hdr);
+        n = hdr;
+    }
+    else
+    {
+        n = pchar_copy_to_iter(kf, pf->rd_pos, to, min_t(size_t, len, avail));
+        if (n == 0)
+            return -EFAULT;
+        WRITE_ONCE(pf->rd_pos, pf->rd_pos + n);
+    }
+    trace_pchar_dequeue(dev_name(&dev->device), n, avail - n);
+    pchar_stat_add(dev, bytes_out, n);
+    return n;
+}
+
+// FIFO_LINK: move the next record, or as many bytes as fit, from src into dst
+// (single queues), straight from one kfifo into the other. called with dst's
+// wr_lock and src's rd_lock held. returns bytes consumed from src; 0 with *need
+// set to the room the next transfer needs in dst (0: src is empty). src is
+// never in overwrite mode, so its head stays put.
+static size_t pchar_fwd_move(pchar_device_t *src, pchar_device_t *dst, size_t *need)
+{
+    struct kfifo *sfifo = &src->queues[0].fifo, *dfifo = &dst->queues[0].fifo;
+    struct __kfifo *skf = &sfifo->kfifo;
+    unsigned int len = kfifo_len(sfifo), avail = kfifo_avail(dfifo);
+    unsigned int hdr_room = dst->record ? PCHAR_REC_HDR : 0, skip = 0, off, n;
+    struct kvec kv[2];
+    struct iov_iter iter;
+    size_t copied;
+
+    *need = 0;
+    if (len == 0)
+        return 0;
+    if (src->record)
+    {
+        u32 hdr;
+        kfifo_out_peek(sfifo, &hdr, sizeof(hdr));
+        skip = PCHAR_REC_HDR;
+        n = hdr;
+        *need = n + hdr_room;
+        if (*need > kfifo_size(dfifo))
+        {
+            // can never fit downstream -- drop it rather than stall the chain
+            smp_wmb();
+            skf->out += skip + n;
+            atomic64_inc(&src->rd_seq);
+            atomic64_inc(&src->lost);
+            pchar_stat_add(src, drops, n);
+            return skip + n;
+        }
+    }
+    else
+    {
+        *need = 1 + hdr_room;
+        n = min(len, avail > hdr_room ? avail - hdr_room : 0);
+    }
+    if (avail < *need)
+        return 0;
+
+    // the (up to two) contiguous regions of the data in src
+    off = (skf->out + skip) & skf->mask;
+    kv[0].iov_base = (unsigned char *)skf->data + off;
+    kv[0].iov_len = min(n, skf->mask + 1 - off);
+    kv[1].iov_base = skf->data;
+    kv[1].iov_len = n - kv[0].iov_len;
+    iov_iter_kvec(&iter, ITER_SOURCE, kv, 2, n);
+    if (dst->record)
+        copied = pchar_rec_from_iter(dfifo, &iter, n);
+    else
+        copied = pchar_fifo_from_iter(dfifo, &iter, n);
+    smp_wmb(); // data must be copied out before the slot is released
+    skf->out += skip + copied;
+    atomic64_add(src->record ? 1 : copied, &src->rd_seq);
+    pchar_stat_add(src, bytes_out, copied);
+    pchar_stat_add(src, reads, 1);
+    pchar_account_in(dst, &dst->queues[0], copied);
+    return skip + copied;
+}
+
+// FIFO_LINK: forward everything queued on src downstream. Runs until src is
+// empty; queued again by every write to src.
+static void pchar_fwd_work(struct work_struct *work)
+{
+    pchar_device_t *src = container_of(work, pchar_device_t, fwd_work);
+    pchar_device_t *dst;
+    pchar_queue_t *dq;
+    size_t need = 1, moved;
+    bool overwrite;
+
+    while ((dst = READ_ONCE(src->link)) != NULL)
+    {
+        dq = &dst->queues[0];
+        // overwrite downstream -- never wait, its oldest data goes instead
+        overwrite = READ_ONCE(dst->overwrite);
+        if (!overwrite && !pchar_wr_ready(dq, need))
+        {
+            // backpressure -- wait for room downstream like a blocked writer. src
+            // fills up meanwhile and its own writers block in turn.
+            pchar_flush_wakeups(dst);
+            pchar_stat_add(dst, wr_blocked, 1);
+            wait_event_interruptible(dst->wr_wq, pchar_wr_ready(dq, need) || READ_ONCE(src->link) != dst ||
+                                     READ_ONCE(dst->overwrite));
+            continue;
+        }
+        mutex_lock(&dq->wr_lock);
+        if (overwrite && kfifo_avail(&dq->fifo) < need && need <= kfifo_size(&dq->fifo))
+        {
+            // a byte stream makes room for all of src at once, not a byte per pass
+            if (!src->record)
+                need = max_t(size_t, need, min_t(size_t, kfifo_len(&src->queues[0].fifo) +
+                                       (dst->record ? PCHAR_REC_HDR : 0), kfifo_size(&dq->fifo)));
+            pchar_overwrite_make_room(dst, dq, need);
+        }
+        mutex_lock(&src->rd_lock);
+        moved = pchar_fwd_move(src, dst, &need);
+        mutex_unlock(&src->rd_lock);
+        mutex_unlock(&dq->wr_lock);
+        if (moved == 0)
+        {
+            if (need == 0)
+                break; // src is empty
+            continue;
+        }
+        need = 1;
+        pchar_notify_writers(src);
+        pchar_notify_readers(dst); // next hop, if dst is chained too
+    }
+}
+
+// non-blocking caller -- O_NONBLOCK file or io_uring/aio IOCB_NOWAIT attempt
+static inline bool pchar_nowait(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static ssize_t pchar_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    pchar_file_t *pf = (pchar_file_t *)iocb->ki_filp->private_data;
+    pchar_device_t *dev = pf->dev;
+    pchar_queue_t *q = READ_ONCE(pf->txq); // FIFO_SET_LANE may move it
+    size_t left = iov_iter_count(from), nbytes, total = 0;
+    bool nowait = pchar_nowait(iocb), rec;
+    int ret;
+    pchar_dbg("pchar_write_iter() called.\n");
+    // in mmap ring mode data moves through the shared ring only
+    if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+        return -EINVAL;
+    if (left == 0)
+        return 0;
+    do
+    {
+        // if buffer is full, block the writer process (or -EAGAIN). writes up to
+        // atomic_size wait for room for all of it, larger ones for any room.
+        ret = pchar_wr_start(dev, q, left, left > READ_ONCE(dev->atomic_size), nowait, &rec);
+        if (ret != 0)
+            break;
+        // gathers all iovec segments (e.g. header + payload) in one go --
+        // in record mode they all become a single record
+        if (rec)
+            nbytes = pchar_rec_from_iter(&q->fifo, from, left);
+        else
+            nbytes = pchar_fifo_from_iter(&q->fifo, from, left);
+        if (nbytes > 0)
+            pchar_account_in(dev, q, nbytes);
+        mutex_unlock(&q->wr_lock);
+        if (nbytes == 0)
+        {
+            pchar_stat_add(dev, errors, 1);
+            pchar_dbg("copy_from_iter() failed.\n");
+            ret = -EFAULT;
+            break;
+        }
+        total += nbytes;
+        left -= nbytes;
+        pchar_pass_wakeup(dev, true);
+        pchar_notify_readers(dev);
+        // FIFO_WRITE_ALL -- a blocking writer goes on until all of it is queued
+    } while (left > 0 && !rec && !nowait && (READ_ONCE(dev->write_flags) & FIFO_WRITE_ALL));
+    // interrupted part way -- report what was queued, like a pipe
+    return total > 0 ? total : ret;
+}
+
+static ssize_t pchar_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    pchar_file_t *pf = (pchar_file_t *)iocb->ki_filp->private_data;
+    pchar_device_t *dev = pf->dev;
+    size_t count = iov_iter_count(to);
+    ssize_t nbytes;
+    bool rec, freed = false;
+    unsigned int bcast;
+    int ret;
+    pchar_dbg("pchar_read_iter() called.\n");
+    if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+        return -EINVAL;
+    if (count == 0)
+        return 0;
+again:
+    // if buffer is empty, block the reader process (or -EAGAIN)
+    ret = pchar_rd_begin(dev, pf, pchar_nowait(iocb));
+    if (ret != 0)
+        return ret;
+    // scatters into all iovec segments in one go -- exactly one record in record mode
+    rec = dev->record;
+    bcast = dev->bcast;
+    if (bcast)
+    {
+        nbytes = pchar_bcast_to_iter(pf, to, count);
+        // the slowest reader may have moved on
+        freed = pchar_bcast_reclaim(dev);
+    }
+    else if (rec)
+        nbytes = pchar_rec_to_iter(dev, to, count);
+    else
+        nbytes = pchar_drain_to_iter(dev, to, count);
+    mutex_unlock(&dev->rd_lock);
+    // overwrite writers dropped it all before we got to it -- wait again
+    if (nbytes == -ENODATA)
+        goto again;
+    // we may hold an exclusive wakeup -- hand it on on every path out
+    pchar_pass_wakeup(dev, false);
+    if (bcast && nbytes == -EOVERFLOW)
+        return nbytes; // broadcast reader lagged -- data it had not read was dropped
+    pchar_stat_add(dev, reads, 1);
+    if (nbytes == -EMSGSIZE)
+        return nbytes; // buffer too small for the record, which stays queued
+    if (nbytes < 0 || (nbytes == 0 && !rec)) // a record may be empty (batch writes)
+    {
+        pchar_stat_add(dev, errors, 1);
+        pchar_dbg("copy_to_iter() failed.\n");
+        return -EFAULT;
+    }
+    // after reading a few bytes, wakeup blocked writer process (if any) -- subject to wr_wmark.
+    // a broadcast read frees space only when the slowest reader moves on.
+    if (!bcast || freed)
+        pchar_notify_writers(dev);
+    return nbytes;
+}
+
+static __poll_t pchar_poll(struct file *pfile, poll_table *wait)
+{
+    pchar_file_t *pf = (pchar_file_t *)pfile->private_data;
+    pchar_device_t *dev = pf->dev;
+    struct pchar_ring_ctrl *ctrl;
+    __poll_t mask = 0;
+    // register on both queues -- readers are woken from rd_wq, writers from wr_wq
+    poll_wait(pfile, &dev->rd_wq, wait);
+    poll_wait(pfile, &dev->wr_wq, wait);
+    ctrl = smp_load_acquire(&dev->ring_ctrl);
+    if (ctrl != NULL)
+    {
+        // mmap ring mode -- readiness comes from the shared head/tail
+        u32 head = smp_load_acquire(&ctrl->head);
+        u32 tail = smp_load_acquire(&ctrl->tail);
+        if (head != tail)
+            mask |= EPOLLIN | EPOLLRDNORM;
+        if (head - tail < dev->ring_size)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        return mask;
+    }
+    if (pchar_rd_ready(dev, pf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (kfifo_avail(&READ_ONCE(pf->txq)->fifo) > (READ_ONCE(dev->record) ? PCHAR_REC_HDR : 0))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+static int pchar_fasync(int fd, struct file *pfile, int on)
+{
+    pchar_device_t *dev = ((pchar_file_t *)pfile->private_data)->dev;
+    return fasync_helper(fd, pfile, on, &dev->async_queue);
+}
+
+// Resize every queue of dev while traffic flows, called with ctl_lock held.
+// New buffers are allocated first, so a failed allocation leaves the device
+// untouched. All queues are then locked and checked before the first swap, so
+// the device is resized as a whole or not at all; readers and writers wait at
+// most for the kernel-to-kernel copies. Queued data that does not fit is
+// dropped (newest bytes) only if truncate is set; otherwise nothing changes and
+// -ENOSPC is returned. *truncated reports the bytes dropped (or that would
+// have been dropped), summed over all queues.
+static int pchar_resize(pchar_device_t *dev, unsigned int size, bool truncate, u64 *truncated)
+{
+    struct kfifo *fifos;
+    unsigned int i, len, keep;
+    pchar_file_t *pf;
+    int ret = 0;
+
+    *truncated = 0;
+    if (!pchar_size_ok(dev->nqueues, size))
+        return -EINVAL;
+    if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+        return -EINVAL;
+    fifos = kcalloc(dev->nqueues, sizeof(struct kfifo), GFP_KERNEL);
+    if (fifos == NULL)
+        return -ENOMEM;
+    for (i = 0; i < dev->nqueues; i++)
+    {
+        ret = pchar_fifo_alloc(&fifos[i], size, dev->node);
+        if (ret < 0)
+            goto kfifo_alloc_failed;
+    }
+
+    for (i = 0; i < dev->nqueues; i++)
+        mutex_lock_nest_lock(&dev->queues[i].wr_lock, &dev->ctl_lock);
+    mutex_lock(&dev->rd_lock);
+    for (i = 0; i < dev->nqueues; i++)
+    {
+        len = kfifo_len(&dev->queues[i].fifo);
+        *truncated += len - min(len, kfifo_size(&fifos[i]));
+    }
+    // truncating would cut a record in half -- record mode never truncates
+    if (*truncated != 0 && (!truncate || dev->record))
+        ret = -ENOSPC;
+    for (i = 0; i < dev->nqueues && ret == 0; i++)
+    {
+        pchar_queue_t *q = &dev->queues[i];
+        len = kfifo_len(&q->fifo);
+        keep = min(len, kfifo_size(&fifos[i]));
+        // broadcast cursors move with the data (out becomes 0)
+        if (dev->bcast)
+        {
+            list_for_each_entry(pf, &dev->readers, rd_node)
+                pf->rd_pos = min(pf->rd_pos - q->fifo.kfifo.out, keep);
+        }
+        // new fifo is empty -- oldest bytes go straight into its linear start
+        kfifo_out(&q->fifo, fifos[i].kfifo.data, keep);
+        fifos[i].kfifo.in = keep;
+        swap(q->fifo, fifos[i]);
+    }
+    mutex_unlock(&dev->rd_lock);
+    for (i = 0; i < dev->nqueues; i++)
+        mutex_unlock(&dev->queues[i].wr_lock);
+    // writers may have room now (or wait for a size they can never get)
+    if (ret == 0)
+        pchar_wake_writers(dev);
+
+kfifo_alloc_failed:
+    // old buffers after the swap, unused new ones otherwise
+    while (i-- > 0)
+        pchar_fifo_free(&fifos[i]);
+    kfree(fifos);
+    return ret;
+}
+
+// switch between byte stream and record mode, called with ctl_lock held.
+// Only an empty device switches, with all producers and consumers locked out.
+static int pchar_set_record(pchar_device_t *dev, bool on)
+{
+    unsigned int i;
+    int ret = 0;
+
+    if (dev->record == on)
+        return 0;
+    for (i = 0; i < dev->nqueues; i++)
+        mutex_lock_nest_lock(&dev->queues[i].wr_lock, &dev->ctl_lock);
+    mutex_lock(&dev->rd_lock);
+    if (pchar_is_empty(dev))
+    {
+        WRITE_ONCE(dev->record, on);
+        // FIFO_GET_SEQ counts in the unit of the mode -- start over in the new one
+        atomic64_set(&dev->rd_seq, 0);
+        atomic64_set(&dev->lost, 0);
+    }
+    else
+        ret = -EBUSY;
+    mutex_unlock(&dev->rd_lock);
+    while (i-- > 0)
+        mutex_unlock(&dev->queues[i].wr_lock);
+    return ret;
+}
+
+// set the broadcast policy, called with ctl_lock held. Like record mode it is
+// switched on/off only on an empty device, with every reader's cursor at the start.
+static int pchar_set_broadcast(pchar_device_t *dev, unsigned long policy)
+{
+    pchar_queue_t *q = &dev->queues[0];
+    pchar_file_t *pf;
+    int ret = 0;
+
+    if (policy > FIFO_BCAST_LAG)
+        return -EINVAL;
+    if (dev->bcast == policy)
+        return 0;
+    if (dev->nqueues > 1 || dev->ring != NULL || dev->link != NULL || dev->linked || dev->overwrite)
+        return -EINVAL;
+    // FIFO_BCAST_BLOCK <-> FIFO_BCAST_LAG -- just the slow reader policy
+    if (dev->bcast != FIFO_BCAST_OFF && policy != FIFO_BCAST_OFF)
+    {
+        WRITE_ONCE(dev->bcast, policy);
+        return 0;
+    }
+    mutex_lock(&q->wr_lock);
+    mutex_lock(&dev->rd_lock);
+    if (pchar_is_empty(dev))
+    {
+        list_for_each_entry(pf, &dev->readers, rd_node)
+        {
+            pf->rd_pos = q->fifo.kfifo.out;
+            pf->lagged = false;
+        }
+        WRITE_ONCE(dev->bcast, policy);
+    }
+    else
+        ret = -EBUSY;
+    mutex_unlock(&dev->rd_lock);
+    mutex_unlock(&q->wr_lock);
+    // sleeping readers now wait for something else
+    if (ret == 0)
+        wake_up_interruptible_all(&dev->rd_wq);
+    return ret;
+}
+
+// sysfs pcharN/bufsize -- size of each device queue; writing it resizes online
+// (never truncates, -ENOSPC if the queued data would not fit)
+static ssize_t bufsize_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    pchar_device_t *dev = container_of(d, pchar_device_t, device);
+    unsigned int size;
+    mutex_lock(&dev->ctl_lock);
+    size = kfifo_size(&dev->queues[0].fifo);
+    mutex_unlock(&dev->ctl_lock);
+    return sysfs_emit(buf, "%u\n", size);
+}
+
+static ssize_t bufsize_store(struct device *d, struct device_attribute *attr, const char *buf, size_t count)
+{
+    pchar_device_t *dev = container_of(d, pchar_device_t, device);
+    unsigned int size;
+    u64 truncated;
+    int ret = kstrtouint(buf, 0, &size);
+    if (ret < 0)
+        return ret;
+    mutex_lock(&dev->ctl_lock);
+    ret = pchar_resize(dev, size, false, &truncated);
+    mutex_unlock(&dev->ctl_lock);
+    return ret < 0 ? ret : count;
+}
+
+// allocate the shared ring: one control page followed by size bytes of data
+static int pchar_ring_setup(pchar_device_t *dev, unsigned long size)
+{
+    struct pchar_ring_ctrl *ctrl;
+    unsigned int i;
+    bool empty;
+    void *ring;
+
+    if (size < PAGE_SIZE || size > RING_MAX || !is_power_of_2(size))
+        return -EINVAL;
+    if (dev->ring != NULL)
+        return -EBUSY;
+    if (dev->bcast != FIFO_BCAST_OFF || dev->link != NULL || dev->linked)
+        return -EINVAL;
+    // data already queued would be stranded -- ring mode never reads the kfifo
+    if (!pchar_is_empty(dev))
+        return -EBUSY;
+    ring = vmalloc_user(PAGE_SIZE + size); // zeroed, mappable to user space
+    if (ring == NULL)
+        return -ENOMEM;
+    ctrl = (struct pchar_ring_ctrl *)ring;
+    ctrl->size = size;
+    ctrl->data_off = PAGE_SIZE;
+    // lock every producer and the consumers out, like FIFO_SET_RECORD, and
+    // publish the ring only once the device is known empty -- nothing that
+    // pchar_poll() or pchar_mmap() may have seen is ever freed again.
+    // Writers recheck ring_ctrl under their queue lock.
+    for (i = 0; i < dev->nqueues; i++)
+        mutex_lock_nest_lock(&dev->queues[i].wr_lock, &dev->ctl_lock);
+    mutex_lock(&dev->rd_lock);
+    empty = pchar_is_empty(dev);
+    if (empty)
+    {
+        dev->ring = ring;
+        dev->ring_size = size;
+        smp_store_release(&dev->ring_ctrl, ctrl); // switch device to ring mode
+    }
+    mutex_unlock(&dev->rd_lock);
+    while (i-- > 0)
+        mutex_unlock(&dev->queues[i].wr_lock);
+    if (!empty)
+    {
+        vfree(ring); // never published
+        return -EBUSY;
+    }
+    return 0;
+}
+
+// FIFO_WRITE_BATCH -- each message goes into the fifo whole or not at all.
+// Only the first message may block (unless O_NONBLOCK); the batch stops at the
+// first message that does not fit. Returns number of messages written.
+static long pchar_write_batch(pchar_file_t *pf, struct file *pfile, struct fifo_batch __user *ubatch)
+{
+    pchar_device_t *dev = pf->dev;
+    pchar_queue_t *q = READ_ONCE(pf->txq);
+    bool nowait = pfile->f_flags & O_NONBLOCK;
+    bool locked = false, rec = false;
+    struct fifo_batch batch;
+    struct fifo_msg msg;
+    struct fifo_msg __user *umsgs;
+    struct iov_iter iter;
+    unsigned int i;
+    size_t nbytes, total = 0;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > FIFO_BATCH_MAX)
+        return -EINVAL;
+    umsgs = u64_to_user_ptr(batch.msgs);
+
+    for (i = 0; i < batch.count; i++)
+    {
+        if (copy_from_user(&msg, &umsgs[i], sizeof(msg)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        if (!locked)
+        {
+            ret = pchar_wr_start(dev, q, msg.len, false, nowait, &rec);
+            if (ret != 0)
+                break;
+            locked = true;
+        }
+        else if (msg.len + (rec ? PCHAR_REC_HDR : 0) > kfifo_avail(&q->fifo))
+        {
+            if (msg.len + (rec ? PCHAR_REC_HDR : 0) > kfifo_size(&q->fifo))
+            {
+                ret = -EMSGSIZE; // can never fit
+                break;
+            }
+            // overwrite -- the rest of the batch goes in too, over the oldest data
+            if (!READ_ONCE(dev->overwrite))
+                break;
+            pchar_overwrite_make_room(dev, q, msg.len + (rec ? PCHAR_REC_HDR : 0));
+        }
+        ret = import_ubuf(ITER_SOURCE, u64_to_user_ptr(msg.buf), msg.len, &iter);
+        if (ret < 0)
+            break;
+        // each message is one record in record mode. Either way a message
+        // that faults part way is not published at all.
+        if (rec)
+            nbytes = pchar_rec_from_iter(&q->fifo, &iter, msg.len);
+        else
+            nbytes = pchar_msg_from_iter(&q->fifo, &iter, msg.len);
+        if (nbytes < msg.len)
+        {
+            pchar_stat_add(dev, errors, 1);
+            ret = -EFAULT;
+            break;
+        }
+        pchar_account_in(dev, q, nbytes);
+        total += nbytes;
+    }
+    if (locked)
+        mutex_unlock(&q->wr_lock);
+    // one wakeup for the whole batch
+    if (total > 0)
+    {
+        pchar_pass_wakeup(dev, true);
+        pchar_notify_readers(dev);
+    }
+
+    // report an error only if no message made it, like sendmmsg()
+    if (i == 0 && batch.count > 0)
+        return ret;
+    if (put_user(i, &ubatch->done))
+        return -EFAULT;
+    return i;
+}
+
+// FIFO_READ_BATCH -- fills messages in order until the fifo is empty, each
+// msg.len is updated with the bytes read. Only the first message may block.
+// In record mode each message receives one record, stopping at a record
+// longer than the message buffer (-EMSGSIZE if it is the first).
+// Returns number of messages filled.
+static long pchar_read_batch(pchar_file_t *pf, struct file *pfile, struct fifo_batch __user *ubatch)
+{
+    pchar_device_t *dev = pf->dev;
+    struct fifo_batch batch;
+    struct fifo_msg msg;
+    struct fifo_msg __user *umsgs;
+    struct iov_iter iter;
+    unsigned int i;
+    ssize_t nbytes;
+    size_t total = 0;
+    int ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > FIFO_BATCH_MAX)
+        return -EINVAL;
+    if (batch.count == 0)
+        return 0;
+    umsgs = u64_to_user_ptr(batch.msgs);
+
+again:
+    ret = pchar_rd_begin(dev, pf, pfile->f_flags & O_NONBLOCK);
+    if (ret != 0)
+        return ret;
+    // broadcast readers have cursors of their own -- read() only
+    if (dev->bcast)
+    {
+        mutex_unlock(&dev->rd_lock);
+        pchar_pass_wakeup(dev, false);
+        return -EINVAL;
+    }
+    for (i = 0; i < batch.count && !pchar_is_empty(dev); i++)
+    {
+        if (copy_from_user(&msg, &umsgs[i], sizeof(msg)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        ret = import_ubuf(ITER_DEST, u64_to_user_ptr(msg.buf), msg.len, &iter);
+        if (ret < 0)
+            break;
+        if (dev->record)
+            nbytes = pchar_rec_to_iter(dev, &iter, msg.len);
+        else
+            nbytes = pchar_drain_to_iter(dev, &iter, msg.len);
+        if (nbytes == -ENODATA && i == 0)
+        {
+            // overwrite writers dropped it all before we got to it -- wait again
+            mutex_unlock(&dev->rd_lock);
+            goto again;
+        }
+        if (nbytes == -ENODATA)
+        {
+            ret = 0;
+            break;
+        }
+        if (nbytes == -EMSGSIZE)
+        {
+            ret = nbytes;
+            break;
+        }
+        pchar_stat_add(dev, reads, 1);
+        if (nbytes < 0 || (nbytes == 0 && msg.len > 0 && !dev->record))
+        {
+            pchar_stat_add(dev, errors, 1);
+            ret = -EFAULT;
+            break;
+        }
+        total += nbytes;
+        if (put_user((__u32)nbytes, &umsgs[i].len))
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&dev->rd_lock);
+    // we may hold an exclusive wakeup -- hand it on even if nothing was read
+    pchar_pass_wakeup(dev, false);
+    if (total > 0)
+        pchar_notify_writers(dev);
+
+    if (i == 0)
+        return ret;
+    if (put_user(i, &ubatch->done))
+        return -EFAULT;
+    return i;
+}
+
+// FIFO_PEEK: copy what the next read() would return without consuming it --
+// the head of the next non-empty queue, or the data at a broadcast reader's
+// cursor. A record is cut to pk.len. Never waits for data.
+// returns the record length in record mode, else bytes copied, or -errno.
+static long pchar_peek(pchar_file_t *pf, struct file *pfile, struct fifo_peek __user *upeek)
+{
+    pchar_device_t *dev = pf->dev;
+    struct fifo_peek pk;
+    struct iov_iter iter;
+    struct __kfifo *kf = NULL;
+    unsigned int pos = 0, avail = 0;
+    size_t n = 0, copied = 0;
+    long ret;
+    int qi;
+
+    if (copy_from_user(&pk, upeek, sizeof(pk)))
+        return -EFAULT;
+    ret = import_ubuf(ITER_DEST, u64_to_user_ptr(pk.buf), pk.len, &iter);
+    if (ret < 0)
+        return ret;
+
+    ret = pchar_lock(&dev->rd_lock, pfile->f_flags & O_NONBLOCK);
+    if (ret != 0)
+        return ret;
+again:
+    if (dev->bcast)
+    {
+        kf = &dev->queues[0].fifo.kfifo;
+        pos = pf->rd_pos;
+        avail = smp_load_acquire(&kf->in) - pos;
+        if (pf->lagged)
+            ret = -EOVERFLOW; // read() reports it first
+    }
+    else if ((qi = pchar_rd_queue(dev)) >= 0)
+    {
+        kf = &dev->queues[qi].fifo.kfifo;
+        pos = READ_ONCE(kf->out);
+        avail = smp_load_acquire(&kf->in) - pos;
+    }
+    if (ret == 0 && avail == 0)
+        ret = -EAGAIN;
+    else if (ret == 0 && dev->record)
+    {
+        ret = pchar_rec_len_at(kf, pos);
+        n = min_t(size_t, pk.len, ret);
+        copied = pchar_copy_to_iter(kf, pos + PCHAR_REC_HDR, &iter, n);
+    }
+    else if (ret == 0)
+    {
+        n = min_t(size_t, pk.len, avail);
+        copied = pchar_copy_to_iter(kf, pos, &iter, n);
+        ret = copied;
+    }
+    // an overwrite writer dropped the head while we copied it -- look again
+    if (!dev->bcast && kf != NULL && !pchar_head_kept(kf, pos))
+    {
+        iov_iter_revert(&iter, copied);
+        kf = NULL;
+        avail = ret = n = copied = 0;
+        goto again;
+    }
+    mutex_unlock(&dev->rd_lock);
+    if (ret < 0)
+        return ret;
+    if (copied < n)
+        return -EFAULT;
+    if (put_user((__u32)copied, &upeek->len))
+        return -EFAULT;
+    return ret;
+}
+
+// FIFO_SKIP: drop the next count bytes (records in record mode) in read()
+// order without copying them out. Counted as read. returns the number dropped.
+static long pchar_skip(pchar_file_t *pf, struct file *pfile, unsigned long count)
+{
+    pchar_device_t *dev = pf->dev;
+    struct __kfifo *kf;
+    unsigned int n, out;
+    unsigned long done = 0;
+    size_t nbytes = 0;
+    bool bcast, freed = false;
+    int ret, qi;
+
+    if (count > INT_MAX)
+        return -EINVAL;
+    ret = pchar_lock(&dev->rd_lock, pfile->f_flags & O_NONBLOCK);
+    if (ret != 0)
+        return ret;
+    bcast = dev->bcast;
+    if (bcast)
+    {
+        // only this reader's cursor moves; the space goes once everyone is past it
+        kf = &dev->queues[0].fifo.kfifo;
+        WRITE_ONCE(pf->lagged, false);
+        while (done < count && pf->rd_pos != smp_load_acquire(&kf->in))
+        {
+            if (dev->record)
+            {
+                n = pchar_rec_len_at(kf, pf->rd_pos);
+                WRITE_ONCE(pf->rd_pos, pf->rd_pos + PCHAR_REC_HDR + n);
+                done++;
+            }
+            else
+            {
+                n = min_t(unsigned long, count - done, kf->in - pf->rd_pos);
+                WRITE_ONCE(pf->rd_pos, pf->rd_pos + n);
+                done += n;
+            }
+            nbytes += n;
+        }
+        freed = pchar_bcast_reclaim(dev);
+    }
+    else
+    {
+        // over the queues the way read() would have taken them
+        while (done < count && (qi = pchar_rd_queue(dev)) >= 0)
+        {
+            kf = &dev->queues[qi].fifo.kfifo;
+            out = READ_ONCE(kf->out);
+            n = smp_load_acquire(&kf->in) - out;
+            if (n == 0)
+                continue; // an overwrite writer dropped it all meanwhile
+            if (dev->record)
+                n = pchar_rec_len_at(kf, out);
+            else
+                n = min_t(unsigned long, count - done, n);
+            // fails on a torn header too -- the writer that dropped it moved out first
+            if (!pchar_release(kf, out, (dev->record ? PCHAR_REC_HDR : 0) + n))
+                continue;
+            done += dev->record ? 1 : n;
+            nbytes += n;
+            pchar_rd_taken(dev, qi, dev->record ? 1 : n);
+        }
+    }
+    mutex_unlock(&dev->rd_lock);
+    if (done == 0)
+        return 0;
+    pchar_stat_add(dev, reads, 1);
+    pchar_stat_add(dev, bytes_out, nbytes);
+    pchar_pass_wakeup(dev, false);
+    if (!bcast || freed)
+        pchar_notify_writers(dev);
+    return done;
+}
+
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    pchar_file_t *pf = (pchar_file_t *)pfile->private_data;
+    pchar_device_t *dev = pf->dev;
+    u64 truncated;
+    unsigned int i;
+    int ret = 0;
+
+    switch (cmd)
+    {
+    case FIFO_RESIZE:
+        // legacy form -- never truncates
+        mutex_lock(&dev->ctl_lock);
+        ret = pchar_resize(dev, (int)param > 0 ? (int)param : 0, false, &truncated);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_RESIZE size=%d (ret=%d)\n", THIS_MODULE->name, (int)param, ret);
+        return ret;
+
+    case FIFO_RESIZE2: {
+        struct fifo_resize rs;
+        if (copy_from_user(&rs, (void __user *)param, sizeof(rs)))
+            return -EFAULT;
+        if (rs.flags & ~FIFO_RESIZE_TRUNCATE)
+            return -EINVAL;
+        mutex_lock(&dev->ctl_lock);
+        ret = pchar_resize(dev, rs.size, rs.flags & FIFO_RESIZE_TRUNCATE, &rs.truncated);
+        mutex_unlock(&dev->ctl_lock);
+        // report truncation even when it was refused
+        if (put_user(rs.truncated, &((struct fifo_resize __user *)param)->truncated))
+            return -EFAULT;
+        pr_info("%s: ioctl - FIFO_RESIZE2 size=%u (ret=%d, truncated=%llu)\n",
+                THIS_MODULE->name, rs.size, ret, rs.truncated);
+        return ret;
+    }
+
+    case FIFO_SET_WATERMARK: {
+        struct fifo_watermark wm;
+        if (copy_from_user(&wm, (void __user *)param, sizeof(wm)))
+            return -EFAULT;
+        if (wm.rd_wmark > BUF_MAX || wm.wr_wmark > BUF_MAX || wm.flush_ns > FLUSH_MAX_NS)
+            return -EINVAL;
+        mutex_lock(&dev->ctl_lock);
+        WRITE_ONCE(dev->rd_wmark, wm.rd_wmark);
+        WRITE_ONCE(dev->wr_wmark, wm.wr_wmark);
+        WRITE_ONCE(dev->flush_ns, wm.flush_ns);
+        // new settings apply to the next transfer -- deliver what was held back so far
+        pchar_flush_wakeups(dev);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_SET_WATERMARK rd=%u wr=%u flush=%lluns\n",
+                THIS_MODULE->name, wm.rd_wmark, wm.wr_wmark, wm.flush_ns);
+        return 0;
+    }
+
+    case FIFO_SET_WRITE_MODE: {
+        struct fifo_write_mode wm;
+        if (copy_from_user(&wm, (void __user *)param, sizeof(wm)))
+            return -EFAULT;
+        if (wm.atomic_size > BUF_MAX || (wm.flags & ~FIFO_WRITE_ALL))
+            return -EINVAL;
+        mutex_lock(&dev->ctl_lock);
+        WRITE_ONCE(dev->atomic_size, wm.atomic_size);
+        WRITE_ONCE(dev->write_flags, wm.flags);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_SET_WRITE_MODE atomic=%u flags=0x%x\n",
+                THIS_MODULE->name, wm.atomic_size, wm.flags);
+        return 0;
+    }
+
+    case FIFO_SET_RECORD:
+        mutex_lock(&dev->ctl_lock);
+        ret = pchar_set_record(dev, param != 0);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_SET_RECORD %s (ret=%d)\n", THIS_MODULE->name, param ? "on" : "off", ret);
+        return ret;
+
+    case FIFO_SET_BROADCAST:
+        mutex_lock(&dev->ctl_lock);
+        ret = pchar_set_broadcast(dev, param);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_SET_BROADCAST policy=%lu (ret=%d)\n", THIS_MODULE->name, param, ret);
+        return ret;
+
+    case FIFO_LINK:
+        mutex_lock(&pchar_devs_lock);
+        ret = pchar_link(dev, (int)param);
+        mutex_unlock(&pchar_devs_lock);
+        pr_info("%s: ioctl - FIFO_LINK fd=%d (ret=%d)\n", THIS_MODULE->name, (int)param, ret);
+        return ret;
+
+    case FIFO_SET_OVERWRITE:
+        mutex_lock(&dev->ctl_lock);
+        if (dev->bcast != FIFO_BCAST_OFF)
+            ret = -EINVAL; // FIFO_BCAST_LAG is the broadcast flavour of this
+        else if (param != 0 && dev->link != NULL)
+            ret = -EINVAL; // see pchar_link()
+        else
+            WRITE_ONCE(dev->overwrite, param != 0);
+        // switched off -- wait out writers that may still drop the head, so
+        // FIFO_LINK can rely on it staying put
+        for (i = 0; ret == 0 && param == 0 && i < dev->nqueues; i++)
+        {
+            mutex_lock(&dev->queues[i].wr_lock);
+            mutex_unlock(&dev->queues[i].wr_lock);
+        }
+        mutex_unlock(&dev->ctl_lock);
+        // blocked writers go on by dropping the oldest data now
+        if (ret == 0 && param != 0)
+            wake_up_interruptible_all(&dev->wr_wq);
+        pr_info("%s: ioctl - FIFO_SET_OVERWRITE %s (ret=%d)\n", THIS_MODULE->name, param ? "on" : "off", ret);
+        return ret;
+
+    case FIFO_GET_SEQ: {
+        struct fifo_seq sq;
+        if (dev->bcast != FIFO_BCAST_OFF)
+            return -EINVAL; // each reader has a cursor of its own
+        mutex_lock(&dev->rd_lock);
+        sq.seq = atomic64_read(&dev->rd_seq);
+        sq.lost = atomic64_read(&dev->lost);
+        mutex_unlock(&dev->rd_lock);
+        if (copy_to_user((void __user *)param, &sq, sizeof(sq)))
+            return -EFAULT;
+        return 0;
+    }
+
+    case FIFO_SET_LANE:
+        // per fd -- the writes already queued stay in the lane they went to
+        if (param >= max(dev->nlanes, 1U))
+            return -EINVAL;
+        if (dev->nlanes)
+            WRITE_ONCE(pf->txq, &dev->queues[param]);
+        pchar_dbg("ioctl - FIFO_SET_LANE lane=%lu\n", param);
+        return 0;
+
+    case FIFO_SET_LANE_QUOTA:
+        if (dev->nlanes == 0 || param > INT_MAX)
+            return -EINVAL;
+        mutex_lock(&dev->ctl_lock);
+        WRITE_ONCE(dev->lane_quota, param);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_SET_LANE_QUOTA quota=%lu\n", THIS_MODULE->name, param);
+        return 0;
+
+    case FIFO_RING_SETUP:
+        mutex_lock(&dev->ctl_lock);
+        ret = pchar_ring_setup(dev, param);
+        mutex_unlock(&dev->ctl_lock);
+        pr_info("%s: ioctl - FIFO_RING_SETUP size=%lu (ret=%d)\n", THIS_MODULE->name, param, ret);
+        return ret;
+
+    case FIFO_RING_KICK:
+        // user space moved head/tail -- wake up whoever is sleeping in poll()
+        if (smp_load_acquire(&dev->ring_ctrl) == NULL)
+            return -EINVAL;
+        if (wq_has_sleeper(&dev->rd_wq))
+            wake_up_interruptible_poll(&dev->rd_wq, EPOLLIN | EPOLLRDNORM);
+        if (wq_has_sleeper(&dev->wr_wq))
+            wake_up_interruptible_poll(&dev->wr_wq, EPOLLOUT | EPOLLWRNORM);
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+        return 0;
+
+    case FIFO_GET_STATS: {
+        struct fifo_stats fs;
+        pchar_get_stats(dev, &fs);
+        if (copy_to_user((void __user *)param, &fs, sizeof(fs)))
+            return -EFAULT;
+        return 0;
+    }
+
+    case FIFO_WRITE_BATCH:
+        // hot path -- no logging per call
+        if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+            return -EINVAL;
+        return pchar_write_batch(pf, pfile, (struct fifo_batch __user *)param);
+
+    case FIFO_READ_BATCH:
+        if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+            return -EINVAL;
+        return pchar_read_batch(pf, pfile, (struct fifo_batch __user *)param);
+
+    case FIFO_PEEK:
+        if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+            return -EINVAL;
+        return pchar_peek(pf, pfile, (struct fifo_peek __user *)param);
+
+    case FIFO_SKIP:
+        if (smp_load_acquire(&dev->ring_ctrl) != NULL)
+            return -EINVAL;
+        return pchar_skip(pf, pfile, param);
+
+    default:
+        pr_err("%s: ioctl - invalid cmd 0x%x\n", THIS_MODULE->name, cmd);
+        return -EINVAL;
+    }
+}
+
+static int pchar_mmap(struct file *pfile, struct vm_area_struct *vma)
+{
+    pchar_device_t *dev = ((pchar_file_t *)pfile->private_data)->dev;
+    struct pchar_ring_ctrl *ctrl = smp_load_acquire(&dev->ring_ctrl);
+
+    if (ctrl == NULL)
+        return -ENODEV; // FIFO_RING_SETUP first
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE + dev->ring_size)
+        return -EINVAL;
+    pchar_dbg("pchar_mmap() mapped ring (%lu bytes).\n", vma->vm_end - vma->vm_start);
+    return remap_vmalloc_range(vma, dev->ring, 0);
+}
+
+// instance names become part of a /dev and sysfs path -- letters, digits, '-'
+// and '_' only
+static bool pchar_ctl_name_valid(const char *name)
+{
+    const char *c;
+
+    if (name[0] == '\0')
+        return false;
+    for (c = name; *c != '\0'; c++)
+    {
+        if (!isalnum(*c) && *c != '-' && *c != '_')
+            return false;
+    }
+    return true;
+}
+
+// /dev/pchar_ctl -- create/destroy device instances at runtime
+static long pchar_ctl_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    struct pchar_ctl_req req;
+    char name[sizeof("pchar-") + PCHAR_NAME_MAX];
+    pchar_device_t *dev;
+    unsigned long idx;
+    int ret;
+
+    if (cmd != PCHAR_CTL_CREATE && cmd != PCHAR_CTL_DESTROY)
+        return -ENOTTY;
+    if (copy_from_user(&req, (void __user *)param, sizeof(req)))
+        return -EFAULT;
+    req.name[sizeof(req.name) - 1] = '\0';
+    if (!pchar_ctl_name_valid(req.name))
+        return -EINVAL;
+    // runtime instances live in a namespace of their own -- never "pchar0" or "null"
+    snprintf(name, sizeof(name), "pchar-%s", req.name);
+
+    mutex_lock(&pchar_devs_lock);
+    switch (cmd)
+    {
+    case PCHAR_CTL_CREATE:
+        dev = pchar_dev_create(name, req.size, req.node, req.lanes);
+        if (IS_ERR(dev))
+        {
+            ret = PTR_ERR(dev);
+            break;
+        }
+        req.minor = MINOR(dev->device.devt);
+        ret = put_user(req.minor, &((struct pchar_ctl_req __user *)param)->minor) ? -EFAULT : 0;
+        pr_info("%s: pchar_ctl - created %s minor %u.\n", THIS_MODULE->name, name, req.minor);
+        break;
+
+    case PCHAR_CTL_DESTROY:
+        ret = -ENOENT;
+        xa_for_each(&pchar_devs, idx, dev)
+        {
+            if (strcmp(dev_name(&dev->device), name) == 0)
+            {
+                ret = pchar_dev_destroy(dev);
+                break;
+            }
+        }
+        pr_info("%s: pchar_ctl - destroy %s (ret=%d).\n", THIS_MODULE->name, name, ret);
+        break;
+
+    default:
+        ret = -ENOTTY;
+    }
+    mutex_unlock(&pchar_devs_lock);
+    return ret;
+}
+
+module_init(pchar_init);
+module_exit(pchar_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Abhishek Shukla");
+MODULE_DESCRIPTION("MY DEVICE DRIVER");
+
+// KUnit suite -- make KUNIT=y (see Makefile)
+#ifdef PCHAR_KUNIT_TEST
+#include "assign2_test.c"
+#endif
@@ -11,12 +11,18 @@
 #include <linux/slab.h>
 #include <linux/wait.h>
 #include <linux/mutex.h>
+#include <linux/jump_label.h>
+#include "pchar_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "pchar_trace.h"
 
 // device operations
 static int pchar_open(struct inode *pinode, struct file *pfile);
 static int pchar_close(struct inode *pinode, struct file *pfile);
 static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset);
 static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset);
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param);
 
 // device & its related info -- device private struct
 #define MAX 32
@@ -25,13 +31,52 @@ typedef struct pchar_device
     struct kfifo buffer;     // the device buffer
     struct cdev cdev;        // cdev struct for the device
     wait_queue_head_t wr_wq; // to block writer process, when buffer is full.
-    struct mutex lock;
+    // kfifo is safe for one producer + one consumer, so readers only need to be
+    // serialized against readers and writers against writers.
+    struct mutex rd_lock;    // serializes consumers
+    struct mutex wr_lock;    // serializes producers
+    struct file *producer;   // declared sole producer (FIFO_CLAIM_PRODUCER) -- skips wr_lock
+    struct file *consumer;   // declared sole consumer (FIFO_CLAIM_CONSUMER) -- skips rd_lock
 } pchar_device_t;
 
 // number of devices -- flexible via module param
 static int devcnt = 4;
 module_param(devcnt, int, 0444);
 
+// debug logging -- off by default and then costs only a patched-out branch (static key).
+// toggle at runtime: echo 1 > /sys/module/<module>/parameters/debug
+static DEFINE_STATIC_KEY_FALSE(pchar_debug_key);
+#define pchar_dbg(fmt, ...)                                            \
+    do                                                                 \
+    {                                                                  \
+        if (static_branch_unlikely(&pchar_debug_key))                  \
+            pr_info("%s: " fmt, THIS_MODULE->name, ##__VA_ARGS__);     \
+    } while (0)
+
+static int pchar_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret = kstrtobool(val, &on);
+    if (ret < 0)
+        return ret;
+    if (on)
+        static_branch_enable(&pchar_debug_key);
+    else
+        static_branch_disable(&pchar_debug_key);
+    return 0;
+}
+
+static int pchar_debug_get(char *buf, const struct kernel_param *kp)
+{
+    return sprintf(buf, "%c\n", static_key_enabled(&pchar_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops pchar_debug_ops = {
+    .set = pchar_debug_set,
+    .get = pchar_debug_get,
+};
+module_param_cb(debug, &pchar_debug_ops, NULL, 0644);
+
 // devices private struct dynamic array
 static pchar_device_t *devices;
 // other global variables
@@ -44,6 +89,7 @@ static struct file_operations pchar_fops = {
     .release = pchar_close,
     .write = pchar_write,
     .read = pchar_read,
+    .unlocked_ioctl = pchar_ioctl,
 };
 
 static int __init pchar_init(void)
@@ -133,7 +179,10 @@ static int __init pchar_init(void)
     // mutex
     for (i = 0; i < devcnt; i++)
     {
-         mutex_init(&devices[i].lock);
+         mutex_init(&devices[i].rd_lock);
+         mutex_init(&devices[i].wr_lock);
+         devices[i].producer = NULL;
+         devices[i].consumer = NULL;
          pr_info("%s: mutex_init() initialized for pchar%d.\n", THIS_MODULE->name, i);
     }
 
@@ -168,7 +217,8 @@ static void __exit pchar_exit(void)
     pr_info("%s: pchar_exit() called.\n", THIS_MODULE->name);
     for (i = devcnt - 1; i >= 0; i--)
     {
-         mutex_destroy(&devices[i].lock);
+         mutex_destroy(&devices[i].wr_lock);
+         mutex_destroy(&devices[i].rd_lock);
          pr_info("%s: mutex_destroy() destroyed mutex for pchar%d.\n", THIS_MODULE->name, i);
     }
     // dealloc device buffers
@@ -209,65 +259,177 @@ static void __exit pchar_exit(void)
 static int pchar_open(struct inode *pinode, struct file *pfile)
 {
     pfile->private_data = container_of(pinode->i_cdev, pchar_device_t, cdev);
-    pr_info("%s: pchar_open() called.\n", THIS_MODULE->name);
+    pchar_dbg("pchar_open() called.\n");
     return 0;
 }
 
 static int pchar_close(struct inode *pinode, struct file *pfile)
 {
-    pr_info("%s: pchar_close() called.\n", THIS_MODULE->name);
+    pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
+    // drop sole producer/consumer claims held by this file (no I/O can be in flight on it now)
+    if (READ_ONCE(dev->producer) == pfile)
+        WRITE_ONCE(dev->producer, NULL);
+    if (READ_ONCE(dev->consumer) == pfile)
+        WRITE_ONCE(dev->consumer, NULL);
+    pchar_dbg("pchar_close() called.\n");
+    return 0;
+}
+
+// take rd/wr lock -- O_NONBLOCK callers only try once and never sleep on the mutex
+static int pchar_lock(struct mutex *lock, struct file *pfile)
+{
+    if (pfile->f_flags & O_NONBLOCK)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    if (mutex_lock_interruptible(lock) != 0)
+        return -ERESTARTSYS;
     return 0;
 }
 
+// lock one side of the fifo unless pfile is the declared owner of that side.
+// returns 1 if locked (caller must unlock), 0 for lock-free owner, or -errno.
+// claims are made under the same lock, so an owner never runs alongside a
+// locked caller; other files are refused while a claim is held.
+static int pchar_lock_side(struct mutex *lock, struct file **owner, struct file *pfile)
+{
+    int ret;
+    if (READ_ONCE(*owner) == pfile)
+        return 0;
+    ret = pchar_lock(lock, pfile);
+    if (ret != 0)
+        return ret;
+    if (*owner != NULL)
+    {
+        mutex_unlock(lock);
+        return -EBUSY;
+    }
+    return 1;
+}
+
+// claim one side of the fifo for pfile -- waits for in-flight locked callers
+static int pchar_claim_side(struct mutex *lock, struct file **owner, struct file *pfile)
+{
+    int ret = 0;
+    if (mutex_lock_interruptible(lock) != 0)
+        return -ERESTARTSYS;
+    if (*owner != NULL && *owner != pfile)
+        ret = -EBUSY;
+    else
+        WRITE_ONCE(*owner, pfile);
+    mutex_unlock(lock);
+    return ret;
+}
+
 static ssize_t pchar_write(struct file *pfile, const char __user *ubuf, size_t ubufsize, loff_t *poffset)
 {
     pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
-    int nbytes, ret;
-    pr_info("%s: pchar_write() called.\n", THIS_MODULE->name);
-    
-    // if buffer is full, block the writer process
-    // the process will wake up when given cond is true i.e. kfifo is not full
-    ret = wait_event_interruptible(dev->wr_wq, !kfifo_is_full(&dev->buffer));
-    // process will wakeup when space is avail in buffer due to reading -- ret == 0
-    // process will wakeup due to signal -- ret == ERESTARTSYS
-    if (ret != 0)
+    int nbytes, ret, locked;
+    pchar_dbg("pchar_write() called.\n");
+
+    for (;;)
     {
-        pr_info("%s: process wakeup due to signal.\n", THIS_MODULE->name);
-        return -ERESTARTSYS; // restart the syscall i.e. write()
+        // if buffer is full, block the writer process. check and wait use the
+        // same condition, so a non-blocking writer never reaches the wait.
+        while (kfifo_is_full(&dev->buffer))
+        {
+            // non-blocking writer never sleeps -- report "try again" when buffer is full
+            if (pfile->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            trace_pchar_block(MINOR(dev->cdev.dev), true);
+            // the process will wake up when given cond is true i.e. kfifo is not full
+            ret = wait_event_interruptible(dev->wr_wq, !kfifo_is_full(&dev->buffer));
+            // process will wakeup when space is avail in buffer due to reading -- ret == 0
+            // process will wakeup due to signal -- ret == ERESTARTSYS
+            if (ret != 0)
+            {
+                pchar_dbg("process wakeup due to signal.\n");
+                return -ERESTARTSYS; // restart the syscall i.e. write()
+            }
+        }
+        locked = pchar_lock_side(&dev->wr_lock, &dev->producer, pfile);
+        if (locked < 0)
+            return locked;
+        if (!kfifo_is_full(&dev->buffer))
+            break;
+        // another writer took the last free byte before we got the lock -- recheck
+        if (locked)
+            mutex_unlock(&dev->wr_lock);
     }
-    ret = mutex_lock_interruptible(&dev->lock);
     ret = kfifo_from_user(&dev->buffer, ubuf, ubufsize, &nbytes);
+    trace_pchar_enqueue(MINOR(dev->cdev.dev), nbytes, kfifo_len(&dev->buffer));
+    if (locked)
+        mutex_unlock(&dev->wr_lock);
     if (ret < 0)
     {
-        pr_err("%s: kfifo_from_user() failed.\n", THIS_MODULE->name);
+        pchar_dbg("kfifo_from_user() failed.\n");
         return ret;
     }
-    mutex_unlock(&dev->lock);
     return nbytes;
 }
 
 static ssize_t pchar_read(struct file *pfile, char __user *ubuf, size_t ubufsize, loff_t *poffset)
 {
     pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
-    int nbytes, ret;
-    pr_info("%s: pchar_read() called.\n", THIS_MODULE->name);
-    ret = mutex_lock_interruptible(&dev->lock);
+    int nbytes, ret, locked;
+    pchar_dbg("pchar_read() called.\n");
+    // non-blocking reader never sleeps -- report "try again" when buffer is empty
+    if ((pfile->f_flags & O_NONBLOCK) && kfifo_is_empty(&dev->buffer))
+        return -EAGAIN;
+    locked = pchar_lock_side(&dev->rd_lock, &dev->consumer, pfile);
+    if (locked < 0)
+        return locked;
+    // another reader may have emptied it meanwhile -- recheck under the lock
+    if ((pfile->f_flags & O_NONBLOCK) && kfifo_is_empty(&dev->buffer))
+    {
+        if (locked)
+            mutex_unlock(&dev->rd_lock);
+        return -EAGAIN;
+    }
     ret = kfifo_to_user(&dev->buffer, ubuf, ubufsize, &nbytes);
+    trace_pchar_dequeue(MINOR(dev->cdev.dev), nbytes, kfifo_len(&dev->buffer));
+    if (locked)
+        mutex_unlock(&dev->rd_lock);
     if (ret < 0)
     {
-        pr_err("%s: kfifo_to_user() failed.\n", THIS_MODULE->name);
+        pchar_dbg("kfifo_to_user() failed.\n");
         return ret;
     }
-    mutex_unlock(&dev->lock);
     // after reading a few bytes, wakeup blocked writer process (if any)
     if (nbytes > 0)
     {
+        trace_pchar_wake(MINOR(dev->cdev.dev), true);
         wake_up_interruptible(&dev->wr_wq);
-        pr_info("%s: the blocked writer process is woken up.\n", THIS_MODULE->name);
+        pchar_dbg("the blocked writer process is woken up.\n");
     }
     return nbytes;
 }
 
+static long pchar_ioctl(struct file *pfile, unsigned int cmd, unsigned long param)
+{
+    pchar_device_t *dev = (pchar_device_t *)pfile->private_data;
+    int ret;
+
+    switch (cmd)
+    {
+    case FIFO_CLAIM_PRODUCER:
+        if (!(pfile->f_mode & FMODE_WRITE))
+            return -EBADF;
+        ret = pchar_claim_side(&dev->wr_lock, &dev->producer, pfile);
+        pr_info("%s: ioctl - FIFO_CLAIM_PRODUCER (ret=%d)\n", THIS_MODULE->name, ret);
+        return ret;
+
+    case FIFO_CLAIM_CONSUMER:
+        if (!(pfile->f_mode & FMODE_READ))
+            return -EBADF;
+        ret = pchar_claim_side(&dev->rd_lock, &dev->consumer, pfile);
+        pr_info("%s: ioctl - FIFO_CLAIM_CONSUMER (ret=%d)\n", THIS_MODULE->name, ret);
+        return ret;
+
+    default:
+        pr_err("%s: ioctl - invalid cmd 0x%x\n", THIS_MODULE->name, cmd);
+        return -EINVAL;
+    }
+}
+
 module_init(pchar_init);
 module_exit(pchar_exit);
 
@@ -0,0 +1,873 @@
+// KUnit suite for the pchar fifo core -- #included at the end of assign2.c when
+// built with `make KUNIT=y` or CONFIG_PCHAR_KUNIT_TEST, so it sees the static
+// functions. Out of tree it needs a CONFIG_KUNIT kernel and runs when the
+// module is loaded, results in /sys/kernel/debug/kunit/pchar/results; in a
+// kernel tree kunit.py runs it under UML or QEMU (recipe in the Makefile).
+//
+// Tests drive the real read_iter/write_iter/ioctl paths on a private device
+// that has no cdev or /dev node: a zeroed struct file carries the pchar_file_t.
+
+#include <kunit/test.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/mman.h>
+
+typedef struct pchar_test_ctx
+{
+    pchar_device_t *dev;
+    pchar_file_t pf;
+    struct file file;        // only private_data and f_flags are used
+} pchar_test_ctx_t;
+
+static void pchar_test_free(void *data)
+{
+    pchar_dev_free(data);
+}
+
+// device with one size byte queue; f_flags O_NONBLOCK for non-blocking io
+static pchar_test_ctx_t *pchar_test_ctx(struct kunit *test, unsigned int size, unsigned int f_flags)
+{
+    pchar_test_ctx_t *t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, t);
+    t->dev = kzalloc(sizeof(pchar_device_t), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, t->dev);
+    pchar_dev_init(t->dev, NUMA_NO_NODE);
+    KUNIT_ASSERT_EQ(test, 0, kunit_add_action_or_reset(test, pchar_test_free, t->dev));
+    KUNIT_ASSERT_EQ(test, 0, pchar_alloc_queues(t->dev, 1, size));
+    t->pf.dev = t->dev;
+    t->pf.txq = &t->dev->queues[0];
+    list_add_tail(&t->pf.rd_node, &t->dev->readers); // open for reading
+    t->file.private_data = &t->pf;
+    t->file.f_flags = f_flags;
+    return t;
+}
+
+// another file open (for reading) on the device of t
+static pchar_test_ctx_t *pchar_test_open(struct kunit *test, pchar_test_ctx_t *t)
+{
+    pchar_test_ctx_t *t2 = kunit_kzalloc(test, sizeof(*t2), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, t2);
+    t2->dev = t->dev;
+    t2->pf.dev = t->dev;
+    t2->pf.txq = &t->dev->queues[0];
+    t2->pf.rd_pos = t->dev->queues[0].fifo.kfifo.in;
+    list_add_tail(&t2->pf.rd_node, &t->dev->readers);
+    t2->file.private_data = &t2->pf;
+    t2->file.f_flags = t->file.f_flags;
+    return t2;
+}
+
+static ssize_t pchar_test_write(pchar_test_ctx_t *t, const void *buf, size_t len)
+{
+    struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, &t->file);
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+    return pchar_write_iter(&kiocb, &iter);
+}
+
+static ssize_t pchar_test_read(pchar_test_ctx_t *t, void *buf, size_t len)
+{
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, &t->file);
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, len);
+    return pchar_read_iter(&kiocb, &iter);
+}
+
+static int pchar_test_resize_to(pchar_test_ctx_t *t, unsigned int size, bool truncate, u64 *truncated)
+{
+    int ret;
+    mutex_lock(&t->dev->ctl_lock);
+    ret = pchar_resize(t->dev, size, truncate, truncated);
+    mutex_unlock(&t->dev->ctl_lock);
+    return ret;
+}
+
+static int pchar_test_set_record(pchar_test_ctx_t *t, bool on)
+{
+    int ret;
+    mutex_lock(&t->dev->ctl_lock);
+    ret = pchar_set_record(t->dev, on);
+    mutex_unlock(&t->dev->ctl_lock);
+    return ret;
+}
+
+// write, read back, counters
+static void pchar_test_write_read(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 32, O_NONBLOCK);
+    static const char msg[] = "hello, pchar";
+    struct fifo_stats fs;
+    char buf[32];
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, msg, sizeof(msg)), (ssize_t)sizeof(msg));
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), (unsigned int)sizeof(msg));
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)sizeof(msg));
+    KUNIT_EXPECT_MEMEQ(test, buf, msg, sizeof(msg));
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+    // empty device, non-blocking reader
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, 0), (ssize_t)0);
+
+    pchar_get_stats(t->dev, &fs);
+    KUNIT_EXPECT_EQ(test, fs.version, (u32)FIFO_STATS_VERSION);
+    KUNIT_EXPECT_EQ(test, fs.size, 32ULL);
+    KUNIT_EXPECT_EQ(test, fs.bytes_in, (u64)sizeof(msg));
+    KUNIT_EXPECT_EQ(test, fs.bytes_out, (u64)sizeof(msg));
+    KUNIT_EXPECT_EQ(test, fs.writes, 1ULL);
+    KUNIT_EXPECT_EQ(test, fs.reads, 1ULL);
+    KUNIT_EXPECT_EQ(test, fs.high_water, (u64)sizeof(msg));
+    KUNIT_EXPECT_EQ(test, fs.errors, 0ULL);
+}
+
+// data that wraps around the end of the buffer comes back in order
+static void pchar_test_wrap(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    char in[22], out[32];
+    int i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = 'a' + i;
+    KUNIT_ASSERT_EQ(test, pchar_test_write(t, in, 12), (ssize_t)12);
+    KUNIT_ASSERT_EQ(test, pchar_test_read(t, out, 8), (ssize_t)8);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 8);
+    // 4 queued at offset 8, the next 10 wrap
+    KUNIT_ASSERT_EQ(test, pchar_test_write(t, in + 12, 10), (ssize_t)10);
+    KUNIT_ASSERT_EQ(test, pchar_test_read(t, out, sizeof(out)), (ssize_t)14);
+    KUNIT_EXPECT_MEMEQ(test, out, in + 8, 14);
+}
+
+// full buffer: partial writes, then -EAGAIN for a non-blocking writer
+static void pchar_test_full(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    char buf[20] = { 0 };
+    struct fifo_stats fs;
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, sizeof(buf)), (ssize_t)16);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 1), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 0), (ssize_t)0);
+    pchar_get_stats(t->dev, &fs);
+    KUNIT_EXPECT_EQ(test, fs.length, 16ULL);
+    KUNIT_EXPECT_EQ(test, fs.avail, 0ULL);
+    KUNIT_EXPECT_EQ(test, fs.wr_blocked, 0ULL); // non-blocking never sleeps
+}
+
+// FIFO_SET_WRITE_MODE atomic_size: small writes land whole or not at all
+static void pchar_test_atomic_size(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    char buf[32] = { 0 };
+
+    t->dev->atomic_size = 8;
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 12), (ssize_t)12);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 8), (ssize_t)-EAGAIN);
+    // larger than atomic_size -- takes what fits
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 20), (ssize_t)4);
+    KUNIT_ASSERT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)16);
+    // an atomic write larger than the buffer can never fit
+    t->dev->atomic_size = 32;
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 20), (ssize_t)-EMSGSIZE);
+}
+
+// record mode keeps write boundaries and never splits a record
+static void pchar_test_record(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    char buf[64] = { 0 };
+
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "a", 1), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "bcd", 3), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "0123456789", 10), (ssize_t)10);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), (unsigned int)(14 + 3 * PCHAR_REC_HDR));
+
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, 2), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, buf[0], 'a');
+    // too small for "bcd" -- the record stays queued
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, 2), (ssize_t)-EMSGSIZE);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)3);
+    KUNIT_EXPECT_MEMEQ(test, buf, "bcd", 3);
+    // mode changes only on an empty device
+    KUNIT_EXPECT_EQ(test, pchar_test_set_record(t, false), -EBUSY);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)10);
+    KUNIT_EXPECT_MEMEQ(test, buf, "0123456789", 10);
+    KUNIT_EXPECT_EQ(test, pchar_test_set_record(t, false), 0);
+    // a record (plus header) larger than the buffer can never fit
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, buf, 64), (ssize_t)-EMSGSIZE);
+}
+
+// FIFO_SKIP drops bytes, or whole records, in read order
+static void pchar_test_skip(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    char buf[64];
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "0123456789", 10), (ssize_t)10);
+    KUNIT_EXPECT_EQ(test, pchar_skip(&t->pf, &t->file, 4), 4L);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, 2), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "45", 2);
+    // more than queued -- takes what there is
+    KUNIT_EXPECT_EQ(test, pchar_skip(&t->pf, &t->file, 100), 4L);
+    KUNIT_EXPECT_EQ(test, pchar_skip(&t->pf, &t->file, 1), 0L);
+
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "a", 1), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "bcd", 3), (ssize_t)3);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "ef", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_skip(&t->pf, &t->file, 2), 2L);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "ef", 2);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+}
+
+// FIFO_PEEK copies what the next read() returns and leaves it queued
+static void pchar_test_peek(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    struct fifo_peek __user *upk;
+    struct fifo_peek pk;
+    char __user *ubuf;
+    unsigned long addr;
+    char buf[16];
+
+    // FIFO_PEEK takes user pointers -- give the test a user mapping
+    addr = kunit_vm_mmap(test, NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    KUNIT_ASSERT_NE_MSG(test, addr, 0UL, "no user mapping");
+    upk = (struct fifo_peek __user *)addr;
+    ubuf = (char __user *)(addr + sizeof(pk));
+    pk.buf = (__u64)(unsigned long)ubuf;
+    pk.len = 4;
+    pk.pad = 0;
+
+    KUNIT_ASSERT_EQ(test, copy_to_user(upk, &pk, sizeof(pk)), 0UL);
+    KUNIT_EXPECT_EQ(test, pchar_peek(&t->pf, &t->file, upk), -EAGAIN); // empty
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "peekaboo", 8), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, pchar_peek(&t->pf, &t->file, upk), 4L);
+    KUNIT_ASSERT_EQ(test, copy_from_user(buf, ubuf, 4), 0UL);
+    KUNIT_EXPECT_MEMEQ(test, buf, "peek", 4);
+    // nothing consumed -- the same again, then read() gets all of it
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 8U);
+    KUNIT_EXPECT_EQ(test, pchar_peek(&t->pf, &t->file, upk), 4L);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->rd_seq), 0LL);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)8);
+    KUNIT_EXPECT_MEMEQ(test, buf, "peekaboo", 8);
+
+    // record mode: the full record length comes back, the copy is cut to pk.len
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "record", 6), (ssize_t)6);
+    KUNIT_ASSERT_EQ(test, copy_to_user(upk, &pk, sizeof(pk)), 0UL);
+    KUNIT_EXPECT_EQ(test, pchar_peek(&t->pf, &t->file, upk), 6L);
+    KUNIT_ASSERT_EQ(test, copy_from_user(&pk, upk, sizeof(pk)), 0UL);
+    KUNIT_EXPECT_EQ(test, pk.len, 4U);
+    KUNIT_ASSERT_EQ(test, copy_from_user(buf, ubuf, 4), 0UL);
+    KUNIT_EXPECT_MEMEQ(test, buf, "reco", 4);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)6);
+    KUNIT_EXPECT_MEMEQ(test, buf, "record", 6);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+}
+
+// FIFO_WRITE_BATCH: a message whose buffer faults part way is not queued at
+// all -- neither its head nor the messages after it; the ones before it are
+static void pchar_test_write_batch_fault(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    struct fifo_batch __user *ubatch;
+    struct fifo_msg __user *umsgs;
+    struct fifo_batch batch;
+    struct fifo_msg msgs[3];
+    char __user *udata;
+    unsigned long addr;
+    char buf[16];
+    u32 done;
+    int i;
+
+    // two user pages with the second unmapped -- a message can run into the hole
+    addr = kunit_vm_mmap(test, NULL, 0, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+    KUNIT_ASSERT_NE_MSG(test, addr, 0UL, "no user mapping");
+    KUNIT_ASSERT_EQ(test, vm_munmap(addr + PAGE_SIZE, PAGE_SIZE), 0);
+    ubatch = (struct fifo_batch __user *)addr;
+    umsgs = (struct fifo_msg __user *)(addr + 64);
+    udata = (char __user *)(addr + PAGE_SIZE - 4);
+    KUNIT_ASSERT_EQ(test, copy_to_user(udata, "abcd", 4), 0UL);
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 3; i++)
+        msgs[i].buf = (__u64)(unsigned long)udata;
+    msgs[0].len = 4;
+    msgs[1].len = 8; // last 4 bytes fault
+    msgs[2].len = 4;
+    KUNIT_ASSERT_EQ(test, copy_to_user(umsgs, msgs, sizeof(msgs)), 0UL);
+    batch.msgs = (__u64)(unsigned long)umsgs;
+    batch.count = 3;
+    batch.done = 0;
+    KUNIT_ASSERT_EQ(test, copy_to_user(ubatch, &batch, sizeof(batch)), 0UL);
+
+    KUNIT_EXPECT_EQ(test, pchar_write_batch(&t->pf, &t->file, ubatch), 1L);
+    KUNIT_ASSERT_EQ(test, get_user(done, &ubatch->done), 0);
+    KUNIT_EXPECT_EQ(test, done, 1U);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 4U);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)4);
+    KUNIT_EXPECT_MEMEQ(test, buf, "abcd", 4);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+
+    // the same in record mode
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_write_batch(&t->pf, &t->file, ubatch), 1L);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), (unsigned int)(4 + PCHAR_REC_HDR));
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)4);
+    KUNIT_EXPECT_MEMEQ(test, buf, "abcd", 4);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+}
+
+// priority lanes: the highest non-empty lane is read first, the quota lets
+// the lowest waiting lane through now and then
+static void pchar_test_lanes(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    char buf[64];
+
+    // three lanes instead of the one queue
+    pchar_free_queues(t->dev);
+    KUNIT_ASSERT_EQ(test, 0, pchar_alloc_queues(t->dev, 3, 64));
+    t->dev->nlanes = 3;
+    t->pf.txq = &t->dev->queues[0];
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "b1", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "b2", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_ioctl(&t->file, FIFO_SET_LANE, 3), -EINVAL);
+    KUNIT_ASSERT_EQ(test, pchar_ioctl(&t->file, FIFO_SET_LANE, 2), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "h1", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "h1", 2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "b1", 2);
+
+    // starvation guard: one high lane read, then the waiting bulk lane
+    KUNIT_ASSERT_EQ(test, pchar_ioctl(&t->file, FIFO_SET_LANE_QUOTA, 1), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "h2", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "h3", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "h2", 2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "b2", 2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "h3", 2);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+}
+
+// turn the one queue of t into n size byte queues, as in sharded mode
+static void pchar_test_shard(struct kunit *test, pchar_test_ctx_t *t, unsigned int n, unsigned int size)
+{
+    pchar_free_queues(t->dev);
+    KUNIT_ASSERT_EQ(test, 0, pchar_alloc_queues(t->dev, n, size));
+    t->pf.txq = &t->dev->queues[0];
+}
+
+// sharded: each producer fills a queue of its own, readers go round-robin
+static void pchar_test_sharded(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    pchar_test_ctx_t *t2;
+    char buf[32];
+
+    pchar_test_shard(test, t, 3, 16);
+    t2 = pchar_test_open(test, t);
+    t2->pf.txq = &t->dev->queues[1];
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "aaaa", 4), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t2, "bbbbbb", 6), (ssize_t)6);
+    KUNIT_EXPECT_EQ(test, kfifo_len(&t->dev->queues[0].fifo), 4U);
+    KUNIT_EXPECT_EQ(test, kfifo_len(&t->dev->queues[1].fifo), 6U);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 10U);
+    // a full queue stops its own producer only
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "012345678901", 12), (ssize_t)12);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "x", 1), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t2, "b", 1), (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)23);
+    KUNIT_EXPECT_MEMEQ(test, buf, "aaaa012345678901bbbbbbb", 23);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+
+    // records -- one at a time, from the queues in turn
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "a1", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "a2", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t2, "b1", 2), (ssize_t)2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "a1", 2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "b1", 2);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)2);
+    KUNIT_EXPECT_MEMEQ(test, buf, "a2", 2);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(t->dev));
+}
+
+// overwrite: a full buffer drops its oldest bytes (records), seq/lost show the gap
+static void pchar_test_overwrite(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 32, O_NONBLOCK);
+    struct fifo_stats fs;
+    char buf[32];
+    int i;
+
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "0123456789abcdefghijklmnopqrstuv", 32), (ssize_t)32);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "x", 1), (ssize_t)-EAGAIN);
+    KUNIT_ASSERT_EQ(test, pchar_ioctl(&t->file, FIFO_SET_OVERWRITE, 1), 0);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "WXYZ", 4), (ssize_t)4);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)32);
+    KUNIT_EXPECT_MEMEQ(test, buf, "456789abcdefghijklmnopqrstuvWXYZ", 32);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->rd_seq), 36LL);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->lost), 4LL);
+    pchar_get_stats(t->dev, &fs);
+    KUNIT_EXPECT_EQ(test, fs.drops, 4ULL);
+
+    // a reader in the middle of a copy-out does not save the oldest data either
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "0123456789abcdefghijklmnopqrstuv", 32), (ssize_t)32);
+    mutex_lock(&t->dev->rd_lock);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(t, "WXYZ", 4), (ssize_t)4);
+    mutex_unlock(&t->dev->rd_lock);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)32);
+    KUNIT_EXPECT_MEMEQ(test, buf, "456789abcdefghijklmnopqrstuvWXYZ", 32);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->lost), 8LL);
+
+    // records go whole -- four 8 byte records fill the buffer. seq/lost now
+    // count records and start over from 0
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->rd_seq), 0LL);
+    for (i = 0; i < 5; i++)
+    {
+        char rec[4] = { 'r', '0', '0', '1' + i };
+        KUNIT_EXPECT_EQ(test, pchar_test_write(t, rec, 4), (ssize_t)4);
+    }
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)4);
+    KUNIT_EXPECT_MEMEQ(test, buf, "r002", 4);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->rd_seq), 2LL);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->lost), 1LL);
+}
+
+// resize keeps the oldest bytes; shrinking below the queued data fails unless truncating
+static void pchar_test_resize(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    char in[10] = "ABCDEFGHIJ", out[16];
+    u64 truncated;
+
+    KUNIT_ASSERT_EQ(test, pchar_test_write(t, in, sizeof(in)), (ssize_t)sizeof(in));
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 64, false, &truncated), 0);
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 64U);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 10U);
+    KUNIT_EXPECT_EQ(test, truncated, 0ULL);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 8, false, &truncated), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, truncated, 2ULL); // would have been dropped
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 64U);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 10U);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 8, true, &truncated), 0);
+    KUNIT_EXPECT_EQ(test, truncated, 2ULL);
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 8U);
+    KUNIT_ASSERT_EQ(test, pchar_test_read(t, out, sizeof(out)), (ssize_t)8);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 8);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 0, false, &truncated), -EINVAL);
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, BUF_MAX + 1U, false, &truncated), -EINVAL);
+    // legacy ioctl -- size by value, rounded up to a power of 2
+    KUNIT_EXPECT_EQ(test, pchar_ioctl(&t->file, FIFO_RESIZE, 100), 0L);
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 128U);
+}
+
+// a resize never cuts a record in half, even when asked to truncate
+static void pchar_test_resize_record(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 64, O_NONBLOCK);
+    char buf[8] = "record";
+    u64 truncated;
+    int i;
+
+    KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, true), 0);
+    for (i = 0; i < 3; i++)
+        KUNIT_ASSERT_EQ(test, pchar_test_write(t, buf, 6), (ssize_t)6);
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 16, true, &truncated), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 64U);
+    for (i = 0; i < 3; i++)
+    {
+        memset(buf, 0, sizeof(buf));
+        KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)6);
+        KUNIT_EXPECT_MEMEQ(test, buf, "record", 6);
+    }
+}
+
+// a sharded resize is all or nothing: a queue that does not fit leaves every
+// queue as it was, even the ones before it that would have fit
+static void pchar_test_sharded_resize(struct kunit *test)
+{
+    pchar_test_ctx_t *t = pchar_test_ctx(test, 16, O_NONBLOCK);
+    pchar_test_ctx_t *t2;
+    char buf[32];
+    u64 truncated;
+    int i;
+
+    pchar_test_shard(test, t, 3, 16);
+    t2 = pchar_test_open(test, t);
+    t2->pf.txq = &t->dev->queues[1];
+    KUNIT_ASSERT_EQ(test, pchar_test_write(t, "aaaa", 4), (ssize_t)4);
+    KUNIT_ASSERT_EQ(test, pchar_test_write(t2, "bbbbbbbbbbbb", 12), (ssize_t)12);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 8, false, &truncated), -ENOSPC);
+    KUNIT_EXPECT_EQ(test, truncated, 4ULL);
+    for (i = 0; i < 3; i++)
+        KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[i].fifo), 16U);
+    KUNIT_EXPECT_EQ(test, pchar_len(t->dev), 16U);
+
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, 8, true, &truncated), 0);
+    KUNIT_EXPECT_EQ(test, truncated, 4ULL);
+    for (i = 0; i < 3; i++)
+        KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[i].fifo), 8U);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(t, buf, sizeof(buf)), (ssize_t)12);
+    KUNIT_EXPECT_MEMEQ(test, buf, "aaaabbbbbbbb", 12);
+
+    // BUF_MAX bounds the queues together, not each of them
+    KUNIT_EXPECT_EQ(test, pchar_test_resize_to(t, BUF_MAX / 2, false, &truncated), -EINVAL);
+    KUNIT_EXPECT_EQ(test, kfifo_size(&t->dev->queues[0].fifo), 8U);
+}
+
+// broadcast: every reader sees all data, space is freed behind the slowest one;
+// FIFO_BCAST_LAG drops the oldest data instead and flags the reader that missed it
+static void pchar_test_broadcast(struct kunit *test)
+{
+    pchar_test_ctx_t *r1 = pchar_test_ctx(test, 16, O_NONBLOCK);
+    pchar_test_ctx_t *r2 = pchar_test_open(test, r1);
+    char in[24], out[32];
+    struct fifo_stats fs;
+    int i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = 'a' + i;
+    KUNIT_ASSERT_EQ(test, pchar_ioctl(&r1->file, FIFO_SET_BROADCAST, FIFO_BCAST_BLOCK), 0L);
+    KUNIT_ASSERT_EQ(test, pchar_test_write(r1, in, 6), (ssize_t)6);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r1, out, sizeof(out)), (ssize_t)6);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 6);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r1, out, sizeof(out)), (ssize_t)-EAGAIN);
+    // r2 still holds all 6 bytes
+    KUNIT_EXPECT_EQ(test, pchar_len(r1->dev), 6U);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r2, out, 4), (ssize_t)4);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 4);
+    KUNIT_EXPECT_EQ(test, pchar_len(r1->dev), 2U);
+
+    // backpressure: 14 bytes free behind r2
+    KUNIT_EXPECT_EQ(test, pchar_test_write(r1, in + 6, 18), (ssize_t)14);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(r1, in, 1), (ssize_t)-EAGAIN);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r2, out, sizeof(out)), (ssize_t)16);
+    KUNIT_EXPECT_MEMEQ(test, out, in + 4, 16);
+    KUNIT_EXPECT_EQ(test, pchar_len(r1->dev), 14U); // r1 has not read those yet
+    // switching off needs an empty device
+    KUNIT_EXPECT_EQ(test, pchar_ioctl(&r1->file, FIFO_SET_BROADCAST, FIFO_BCAST_OFF), (long)-EBUSY);
+
+    // lag policy: writers drop what r1 has not read
+    KUNIT_ASSERT_EQ(test, pchar_ioctl(&r1->file, FIFO_SET_BROADCAST, FIFO_BCAST_LAG), 0L);
+    KUNIT_EXPECT_EQ(test, pchar_test_write(r1, in, 8), (ssize_t)8);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r1, out, sizeof(out)), (ssize_t)-EOVERFLOW);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r1, out, sizeof(out)), (ssize_t)16);
+    KUNIT_EXPECT_MEMEQ(test, out, in + 12, 8); // oldest 6 of r1's unread bytes are gone
+    KUNIT_EXPECT_MEMEQ(test, out + 8, in, 8);
+    KUNIT_EXPECT_EQ(test, pchar_test_read(r2, out, sizeof(out)), (ssize_t)8);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 8);
+    pchar_get_stats(r1->dev, &fs);
+    KUNIT_EXPECT_EQ(test, fs.drops, 6ULL);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(r1->dev));
+    KUNIT_EXPECT_EQ(test, pchar_ioctl(&r1->file, FIFO_SET_BROADCAST, FIFO_BCAST_OFF), 0L);
+}
+
+// FIFO_LINK: data written to src comes out of dst; what dst has no room for
+// waits in src until dst is read
+static void pchar_test_link(struct kunit *test)
+{
+    pchar_test_ctx_t *src = pchar_test_ctx(test, 32, O_NONBLOCK);
+    pchar_test_ctx_t *dst = pchar_test_ctx(test, 16, O_NONBLOCK);
+    char in[24], out[32];
+    int i, n = 0, tries;
+    ssize_t ret;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = 'A' + i;
+    // what pchar_link() does, minus the device table
+    dst->dev->linked = true;
+    WRITE_ONCE(src->dev->link, dst->dev);
+
+    KUNIT_ASSERT_EQ(test, pchar_test_write(src, in, 10), (ssize_t)10);
+    flush_work(&src->dev->fwd_work);
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(src->dev));
+    KUNIT_EXPECT_EQ(test, pchar_test_read(dst, out, sizeof(out)), (ssize_t)10);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 10);
+
+    KUNIT_ASSERT_EQ(test, pchar_test_write(src, in, 24), (ssize_t)24);
+    for (tries = 0; n < 24 && tries < 1000; tries++)
+    {
+        ret = pchar_test_read(dst, out + n, sizeof(out) - n);
+        if (ret > 0)
+            n += ret;
+        else
+            msleep(1);
+    }
+    KUNIT_EXPECT_EQ(test, n, 24);
+    KUNIT_EXPECT_MEMEQ(test, out, in, 24);
+
+    // as pchar_unlink()
+    WRITE_ONCE(src->dev->link, NULL);
+    wake_up_interruptible_all(&dst->dev->wr_wq);
+    cancel_work_sync(&src->dev->fwd_work);
+}
+
+// concurrent producers/consumer -- blocking records of (producer, sequence),
+// checked for loss, duplication and per-producer order
+#define PCHAR_TEST_PRODUCERS 4
+#define PCHAR_TEST_RECORDS 20000
+#define PCHAR_TEST_BYTES 0x1   // byte mode, each record one atomic write
+#define PCHAR_TEST_SHARDED 0x2 // a queue per producer
+
+typedef struct pchar_test_rec
+{
+    u32 id;
+    u32 seq;
+} pchar_test_rec_t;
+
+typedef struct pchar_test_stress pchar_test_stress_t;
+
+typedef struct pchar_test_worker
+{
+    struct work_struct work;
+    pchar_test_stress_t *s;
+    pchar_test_ctx_t *t;     // the file this one writes to
+    u32 id;
+} pchar_test_worker_t;
+
+struct pchar_test_stress
+{
+    pchar_test_ctx_t *t;
+    pchar_test_worker_t prod[PCHAR_TEST_PRODUCERS];
+    pchar_test_worker_t cons;
+    u32 next[PCHAR_TEST_PRODUCERS]; // consumer: next sequence expected per producer
+    unsigned int got;
+    atomic_t errors;
+    bool done;                      // consumer finished
+};
+
+static void pchar_test_produce(struct work_struct *work)
+{
+    pchar_test_worker_t *w = container_of(work, pchar_test_worker_t, work);
+    pchar_test_rec_t rec = { .id = w->id };
+
+    for (rec.seq = 0; rec.seq < PCHAR_TEST_RECORDS; rec.seq++)
+    {
+        if (pchar_test_write(w->t, &rec, sizeof(rec)) != sizeof(rec))
+        {
+            atomic_inc(&w->s->errors);
+            return;
+        }
+    }
+}
+
+static void pchar_test_consume(struct work_struct *work)
+{
+    pchar_test_stress_t *s = container_of(work, pchar_test_worker_t, work)->s;
+    pchar_test_rec_t rec;
+
+    while (s->got < PCHAR_TEST_PRODUCERS * PCHAR_TEST_RECORDS)
+    {
+        if (pchar_test_read(s->t, &rec, sizeof(rec)) != sizeof(rec))
+        {
+            atomic_inc(&s->errors);
+            break;
+        }
+        s->got++;
+        // keep draining after a bad record so the producers can finish
+        if (rec.id >= PCHAR_TEST_PRODUCERS || rec.seq != s->next[rec.id])
+            atomic_inc(&s->errors);
+        else
+            s->next[rec.id]++;
+    }
+    smp_store_release(&s->done, true);
+}
+
+// mode: PCHAR_TEST_* flags, 0 for records through one queue
+static pchar_test_stress_t *pchar_test_stress_start(struct kunit *test, unsigned int size, unsigned int mode)
+{
+    pchar_test_stress_t *s = kunit_kzalloc(test, sizeof(*s), GFP_KERNEL);
+    int i;
+
+    KUNIT_ASSERT_NOT_NULL(test, s);
+    s->t = pchar_test_ctx(test, size, 0); // blocking
+    if (mode & PCHAR_TEST_SHARDED)
+        pchar_test_shard(test, s->t, PCHAR_TEST_PRODUCERS, size);
+    // whole records only ever sit in the fifo then, a read of one gets one
+    if (mode & PCHAR_TEST_BYTES)
+        s->t->dev->atomic_size = sizeof(pchar_test_rec_t);
+    else
+        KUNIT_ASSERT_EQ(test, pchar_test_set_record(s->t, true), 0);
+    atomic_set(&s->errors, 0);
+    s->cons.s = s;
+    INIT_WORK(&s->cons.work, pchar_test_consume);
+    for (i = 0; i < PCHAR_TEST_PRODUCERS; i++)
+    {
+        s->prod[i].s = s;
+        s->prod[i].t = s->t;
+        if (mode & PCHAR_TEST_SHARDED)
+        {
+            s->prod[i].t = pchar_test_open(test, s->t);
+            s->prod[i].t->pf.txq = &s->t->dev->queues[i];
+        }
+        s->prod[i].id = i;
+        INIT_WORK(&s->prod[i].work, pchar_test_produce);
+        queue_work(system_unbound_wq, &s->prod[i].work);
+    }
+    queue_work(system_unbound_wq, &s->cons.work);
+    return s;
+}
+
+static void pchar_test_stress_finish(struct kunit *test, pchar_test_stress_t *s)
+{
+    struct fifo_stats fs;
+    int i;
+
+    for (i = 0; i < PCHAR_TEST_PRODUCERS; i++)
+        flush_work(&s->prod[i].work);
+    flush_work(&s->cons.work);
+    KUNIT_EXPECT_EQ(test, atomic_read(&s->errors), 0);
+    KUNIT_EXPECT_EQ(test, s->got, (unsigned int)(PCHAR_TEST_PRODUCERS * PCHAR_TEST_RECORDS));
+    KUNIT_EXPECT_TRUE(test, pchar_is_empty(s->t->dev));
+    pchar_get_stats(s->t->dev, &fs);
+    KUNIT_EXPECT_EQ(test, fs.bytes_in, fs.bytes_out);
+    KUNIT_EXPECT_EQ(test, fs.errors, 0ULL);
+    kunit_info(test, "writers blocked %llu, readers blocked %llu, wakeups %llu (%llu avoided)\n",
+               fs.wr_blocked, fs.rd_blocked, fs.wakeups, fs.wakeups_avoided);
+}
+
+static void pchar_test_stress(struct kunit *test)
+{
+    pchar_test_stress_t *s = pchar_test_stress_start(test, 256, 0);
+    pchar_test_stress_finish(test, s);
+}
+
+static void pchar_test_stress_bytes(struct kunit *test)
+{
+    pchar_test_stress_t *s = pchar_test_stress_start(test, 256, PCHAR_TEST_BYTES);
+    pchar_test_stress_finish(test, s);
+}
+
+static void pchar_test_stress_sharded(struct kunit *test)
+{
+    pchar_test_stress_t *s = pchar_test_stress_start(test, 64, PCHAR_TEST_SHARDED);
+    pchar_test_stress_finish(test, s);
+}
+
+static void pchar_test_stress_sharded_bytes(struct kunit *test)
+{
+    pchar_test_stress_t *s = pchar_test_stress_start(test, 64, PCHAR_TEST_SHARDED | PCHAR_TEST_BYTES);
+    pchar_test_stress_finish(test, s);
+}
+
+// resize back and forth while producers and the consumer run
+static void pchar_test_resize_under_load(struct kunit *test)
+{
+    static const unsigned int sizes[] = { 64, 4096, 128, 1024 };
+    pchar_test_stress_t *s = pchar_test_stress_start(test, 256, 0);
+    unsigned int n = 0, refused = 0;
+    u64 truncated;
+    int ret;
+
+    while (!smp_load_acquire(&s->done))
+    {
+        ret = pchar_test_resize_to(s->t, sizes[n++ % ARRAY_SIZE(sizes)], true, &truncated);
+        // record mode never truncates -- a shrink may be refused
+        if (ret == -ENOSPC)
+            refused++;
+        else
+            KUNIT_EXPECT_EQ(test, ret, 0);
+        cond_resched();
+    }
+    pchar_test_stress_finish(test, s);
+    kunit_info(test, "%u resizes, %u refused\n", n, refused);
+}
+
+// enqueue/dequeue cost -- fill the buffer, then drain it, timing each half.
+// informational only, nothing is asserted about the numbers.
+#define PCHAR_BENCH_SIZE (64 * 1024)
+#define PCHAR_BENCH_ROUNDS 64
+
+static void pchar_test_bench(struct kunit *test)
+{
+    static const size_t msgsizes[] = { 8, 64, 512, 4096 };
+    pchar_test_ctx_t *t = pchar_test_ctx(test, PCHAR_BENCH_SIZE, O_NONBLOCK);
+    char *buf = kunit_kzalloc(test, 4096, GFP_KERNEL);
+    int i, r, mode;
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    for (mode = 0; mode < 2; mode++)
+    {
+        KUNIT_ASSERT_EQ(test, pchar_test_set_record(t, mode == 1), 0);
+        for (i = 0; i < ARRAY_SIZE(msgsizes); i++)
+        {
+            size_t len = msgsizes[i];
+            unsigned int per_round = PCHAR_BENCH_SIZE / (len + (mode ? PCHAR_REC_HDR : 0));
+            u64 t_in = 0, t_out = 0, t0, ops = 0;
+            unsigned int n;
+
+            for (r = 0; r < PCHAR_BENCH_ROUNDS; r++)
+            {
+                t0 = ktime_get_ns();
+                for (n = 0; n < per_round; n++)
+                    KUNIT_ASSERT_EQ(test, pchar_test_write(t, buf, len), (ssize_t)len);
+                t_in += ktime_get_ns() - t0;
+                t0 = ktime_get_ns();
+                for (n = 0; n < per_round; n++)
+                    KUNIT_ASSERT_EQ(test, pchar_test_read(t, buf, len), (ssize_t)len);
+                t_out += ktime_get_ns() - t0;
+                ops += per_round;
+            }
+            kunit_info(test, "%s %4zu bytes: enqueue %llu ns/op, dequeue %llu ns/op\n",
+                       mode ? "record" : "byte  ", len, div64_u64(t_in, ops), div64_u64(t_out, ops));
+        }
+    }
+}
+
+static struct kunit_case pchar_test_cases[] = {
+    KUNIT_CASE(pchar_test_write_read),
+    KUNIT_CASE(pchar_test_wrap),
+    KUNIT_CASE(pchar_test_full),
+    KUNIT_CASE(pchar_test_atomic_size),
+    KUNIT_CASE(pchar_test_record),
+    KUNIT_CASE(pchar_test_skip),
+    KUNIT_CASE(pchar_test_peek),
+    KUNIT_CASE(pchar_test_write_batch_fault),
+    KUNIT_CASE(pchar_test_lanes),
+    KUNIT_CASE(pchar_test_sharded),
+    KUNIT_CASE(pchar_test_overwrite),
+    KUNIT_CASE(pchar_test_resize),
+    KUNIT_CASE(pchar_test_resize_record),
+    KUNIT_CASE(pchar_test_sharded_resize),
+    KUNIT_CASE(pchar_test_broadcast),
+    KUNIT_CASE(pchar_test_link),
+    KUNIT_CASE_SLOW(pchar_test_stress),
+    KUNIT_CASE_SLOW(pchar_test_stress_bytes),
+    KUNIT_CASE_SLOW(pchar_test_stress_sharded),
+    KUNIT_CASE_SLOW(pchar_test_stress_sharded_bytes),
+    KUNIT_CASE_SLOW(pchar_test_resize_under_load),
+    KUNIT_CASE_SLOW(pchar_test_bench),
+    {}
+};
+
+static struct kunit_suite pchar_test_suite = {
+    .name = "pchar",
+    .test_cases = pchar_test_cases,
+};
+kunit_test_suite(pchar_test_suite);
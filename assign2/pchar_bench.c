@@ -0,0 +1,567 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include "pchar_ioctl.h"
+
+// pchar_bench -- throughput / latency sweep for the pchar devices.
+// every combination of device count, buffer size, producer count, consumer
+// count and message size runs for a fixed time. producers write fixed size
+// messages stamped with CLOCK_MONOTONIC, consumers read them back and record
+// the latency. one result line (CSV or JSON) per combination goes to stdout.
+//
+// messages stay whole because the devices are put in atomic write mode
+// (FIFO_SET_WRITE_MODE, atomic_size = message size) and every read asks for
+// exactly one message -- the fifo only ever holds whole messages then.
+// works against both assign2.ko and the single device assign1 pchar.ko.
+//
+// by default the threads use plain blocking read()/write(), so the driver's
+// own sleep and wakeup paths are what gets measured (wr_blocked, rd_blocked,
+// wakeups, wakeups_avoided). -m poll opens every fd O_NONBLOCK and waits in
+// poll() instead. at the end of a run blocked threads are kicked out of the
+// driver with SIGUSR1.
+
+#define MAX_LIST    32
+#define MAX_DEVS    64
+#define LAT_SAMPLES 200000  // latency samples kept per consumer (reservoir)
+#define POLL_MS     100
+
+struct list
+{
+    int n;
+    long v[MAX_LIST];
+};
+
+struct bench
+{
+    size_t msgsize;
+    int block;              // blocking I/O, else O_NONBLOCK + poll()
+    volatile int stop;      // producers stop
+    volatile int done;      // producers gone, consumers drain and stop
+};
+
+struct worker
+{
+    pthread_t tid;
+    struct bench *b;
+    int fd;
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t *lat;          // consumers only
+    size_t nlat;
+    uint64_t seen;          // samples offered to the reservoir
+    uint64_t rng;
+    long nvcsw;
+    long nivcsw;
+    volatile int exited;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// context switches of the calling thread
+static void thread_csw(struct worker *w)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) == 0)
+    {
+        w->nvcsw = ru.ru_nvcsw;
+        w->nivcsw = ru.ru_nivcsw;
+    }
+}
+
+// SIGUSR1 only has to interrupt a blocked read()/write() (no SA_RESTART)
+static void kick(int sig)
+{
+    (void)sig;
+}
+
+// wait for the fd to become ready. devices without a poll method (assign1)
+// report ready at once -- yield so the busy loop does not starve the peer.
+static void wait_fd(int fd, short events)
+{
+    struct pollfd pfd = { .fd = fd, .events = events };
+    if (poll(&pfd, 1, POLL_MS) > 0)
+        sched_yield();
+}
+
+static void *producer(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+    char *buf = calloc(1, b->msgsize);
+    ssize_t ret;
+
+    if (buf == NULL)
+        return NULL;
+    while (!b->stop)
+    {
+        if (b->msgsize >= sizeof(uint64_t))
+        {
+            uint64_t t = now_ns();
+            memcpy(buf, &t, sizeof(t));
+        }
+        ret = write(w->fd, buf, b->msgsize);
+        if (ret == (ssize_t)b->msgsize)
+        {
+            w->msgs++;
+            w->bytes += ret;
+        }
+        else if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("write");
+            break;
+        }
+        else if (ret < 0 && !b->block)
+            wait_fd(w->fd, POLLOUT);
+    }
+    thread_csw(w);
+    free(buf);
+    w->exited = 1;
+    return NULL;
+}
+
+static void record_latency(struct worker *w, uint64_t ns)
+{
+    uint64_t slot;
+    // reservoir sampling -- keeps a uniform sample of long runs
+    if (w->nlat < LAT_SAMPLES)
+    {
+        w->lat[w->nlat++] = ns;
+        w->seen++;
+        return;
+    }
+    slot = xorshift(&w->rng) % ++w->seen;
+    if (slot < LAT_SAMPLES)
+        w->lat[slot] = ns;
+}
+
+static void *consumer(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->b;
+    char *buf = malloc(b->msgsize);
+    ssize_t ret;
+
+    if (buf == NULL)
+        return NULL;
+    for (;;)
+    {
+        ret = read(w->fd, buf, b->msgsize);
+        if (ret > 0)
+        {
+            w->msgs++;
+            w->bytes += ret;
+            if (ret >= (ssize_t)sizeof(uint64_t))
+            {
+                uint64_t t;
+                memcpy(&t, buf, sizeof(t));
+                record_latency(w, now_ns() - t);
+            }
+            continue;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("read");
+            break;
+        }
+        // empty -- finished once the producers are gone
+        if (b->done)
+            break;
+        if (!b->block)
+            wait_fd(w->fd, POLLIN);
+        else if (ret == 0)
+            sched_yield(); // assign1 reports an empty fifo as EOF
+    }
+    thread_csw(w);
+    free(buf);
+    w->exited = 1;
+    return NULL;
+}
+
+static int parse_list(const char *s, struct list *l)
+{
+    char *copy = strdup(s), *tok, *save = NULL;
+    l->n = 0;
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *end;
+        long v = strtol(tok, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            v <<= 10, end++;
+        else if (*end == 'm' || *end == 'M')
+            v <<= 20, end++;
+        if (*end != '\0' || v < 0 || l->n == MAX_LIST)
+        {
+            free(copy);
+            return -1;
+        }
+        l->v[l->n++] = v;
+    }
+    free(copy);
+    return l->n ? 0 : -1;
+}
+
+// bring a device into a known state: empty, given size, atomic writes
+static int setup_dev(const char *path, long bufsize, size_t msgsize)
+{
+    struct fifo_write_mode wm = { .atomic_size = msgsize, .flags = 0 };
+    char buf[4096];
+    int fd = open(path, O_RDWR | O_NONBLOCK);
+
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    if (bufsize && ioctl(fd, FIFO_RESIZE, (int)bufsize) < 0)
+    {
+        fprintf(stderr, "%s: FIFO_RESIZE %ld: %s\n", path, bufsize, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (ioctl(fd, FIFO_SET_WRITE_MODE, &wm) < 0)
+    {
+        fprintf(stderr, "%s: FIFO_SET_WRITE_MODE: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// per device kernel counters, summed over the devices of a run
+static void sum_stats(char **paths, int ndev, struct fifo_stats *sum)
+{
+    int i;
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < ndev; i++)
+    {
+        struct fifo_stats fs;
+        int fd = open(paths[i], O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            continue;
+        memset(&fs, 0, sizeof(fs));
+        if (ioctl(fd, FIFO_GET_STATS, &fs) == 0)
+        {
+            sum->wr_blocked += fs.wr_blocked;
+            sum->rd_blocked += fs.rd_blocked;
+            sum->wakeups += fs.wakeups;
+            sum->wakeups_avoided += fs.wakeups_avoided;
+        }
+        close(fd);
+    }
+}
+
+// join threads [from, to). a blocking one may sleep in the driver with no
+// one left to wake it -- kick it with SIGUSR1 until it notices and exits.
+static void join_workers(struct worker *w, int from, int to, int block)
+{
+    struct timespec ms = { 0, 1000000 };
+    int i, busy = block;
+
+    while (busy)
+    {
+        busy = 0;
+        for (i = from; i < to; i++)
+        {
+            if (!w[i].exited)
+            {
+                pthread_kill(w[i].tid, SIGUSR1);
+                busy = 1;
+            }
+        }
+        if (busy)
+            nanosleep(&ms, NULL);
+    }
+    for (i = from; i < to; i++)
+        pthread_join(w[i].tid, NULL);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const uint64_t *v, size_t n, double p)
+{
+    return n ? v[(size_t)(p * (n - 1))] : 0;
+}
+
+struct result
+{
+    int ndev, nprod, ncons, block;
+    long bufsize;
+    size_t msgsize;
+    double secs;
+    uint64_t msgs, bytes;
+    uint64_t p50, p99, p999;
+    long nvcsw, nivcsw;
+    struct fifo_stats ks;   // kernel counter deltas
+};
+
+static int run(char **paths, int ndev, long bufsize, int nprod, int ncons,
+               size_t msgsize, int block, double secs, struct result *r)
+{
+    struct bench b = { .msgsize = msgsize, .block = block };
+    struct worker *w = calloc(nprod + ncons, sizeof(*w));
+    struct fifo_stats before, after;
+    struct timespec ts;
+    uint64_t *all = NULL, t0;
+    size_t nall = 0;
+    int i, ret = -1;
+
+    if (w == NULL)
+        return -1;
+    for (i = 0; i < ndev; i++)
+        if (setup_dev(paths[i], bufsize, msgsize) < 0)
+            goto out;
+    sum_stats(paths, ndev, &before);
+
+    // thread i talks to device i % ndev, each on its own fd
+    for (i = 0; i < nprod + ncons; i++)
+    {
+        w[i].b = &b;
+        w[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        w[i].fd = open(paths[i % ndev], (i < nprod ? O_WRONLY : O_RDONLY) | (block ? 0 : O_NONBLOCK));
+        if (w[i].fd < 0)
+        {
+            perror(paths[i % ndev]);
+            goto out;
+        }
+        if (i >= nprod && (w[i].lat = malloc(LAT_SAMPLES * sizeof(uint64_t))) == NULL)
+            goto out;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < nprod + ncons; i++)
+        pthread_create(&w[i].tid, NULL, i < nprod ? producer : consumer, &w[i]);
+
+    ts.tv_sec = (time_t)secs;
+    ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+    b.stop = 1;
+    join_workers(w, 0, nprod, block);
+    b.done = 1;
+    join_workers(w, nprod, nprod + ncons, block);
+
+    memset(r, 0, sizeof(*r));
+    r->secs = (now_ns() - t0) / 1e9;
+    r->ndev = ndev;
+    r->bufsize = bufsize;
+    r->nprod = nprod;
+    r->ncons = ncons;
+    r->msgsize = msgsize;
+    r->block = block;
+    for (i = 0; i < nprod + ncons; i++)
+    {
+        r->nvcsw += w[i].nvcsw;
+        r->nivcsw += w[i].nivcsw;
+        if (i >= nprod)
+        {
+            r->msgs += w[i].msgs;
+            r->bytes += w[i].bytes;
+            nall += w[i].nlat;
+        }
+    }
+
+    all = malloc((nall ? nall : 1) * sizeof(uint64_t));
+    if (all == NULL)
+        goto out;
+    nall = 0;
+    for (i = nprod; i < nprod + ncons; i++)
+    {
+        memcpy(all + nall, w[i].lat, w[i].nlat * sizeof(uint64_t));
+        nall += w[i].nlat;
+    }
+    qsort(all, nall, sizeof(uint64_t), cmp_u64);
+    r->p50 = pct(all, nall, 0.50);
+    r->p99 = pct(all, nall, 0.99);
+    r->p999 = pct(all, nall, 0.999);
+
+    sum_stats(paths, ndev, &after);
+    r->ks.wr_blocked = after.wr_blocked - before.wr_blocked;
+    r->ks.rd_blocked = after.rd_blocked - before.rd_blocked;
+    r->ks.wakeups = after.wakeups - before.wakeups;
+    r->ks.wakeups_avoided = after.wakeups_avoided - before.wakeups_avoided;
+    ret = 0;
+out:
+    for (i = 0; i < nprod + ncons; i++)
+    {
+        if (w[i].fd > 0)
+            close(w[i].fd);
+        free(w[i].lat);
+    }
+    free(all);
+    free(w);
+    return ret;
+}
+
+static void print_result(const struct result *r, int json, int first)
+{
+    double mbps = r->bytes / r->secs / (1024 * 1024);
+    double mps = r->msgs / r->secs;
+
+    if (json)
+    {
+        printf("%s  {\"devices\": %d, \"bufsize\": %ld, \"producers\": %d, \"consumers\": %d, "
+               "\"msgsize\": %zu, \"mode\": \"%s\", \"secs\": %.3f, \"msgs\": %llu, \"bytes\": %llu, "
+               "\"mb_per_s\": %.2f, \"msgs_per_s\": %.0f, "
+               "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, "
+               "\"vol_csw\": %ld, \"invol_csw\": %ld, "
+               "\"wr_blocked\": %llu, \"rd_blocked\": %llu, "
+               "\"wakeups\": %llu, \"wakeups_avoided\": %llu}",
+               first ? "" : ",\n", r->ndev, r->bufsize, r->nprod, r->ncons,
+               r->msgsize, r->block ? "block" : "poll", r->secs,
+               (unsigned long long)r->msgs, (unsigned long long)r->bytes, mbps, mps,
+               (unsigned long long)r->p50, (unsigned long long)r->p99, (unsigned long long)r->p999,
+               r->nvcsw, r->nivcsw,
+               (unsigned long long)r->ks.wr_blocked, (unsigned long long)r->ks.rd_blocked,
+               (unsigned long long)r->ks.wakeups, (unsigned long long)r->ks.wakeups_avoided);
+        return;
+    }
+    printf("%d,%ld,%d,%d,%zu,%s,%.3f,%llu,%llu,%.2f,%.0f,%llu,%llu,%llu,%ld,%ld,%llu,%llu,%llu,%llu\n",
+           r->ndev, r->bufsize, r->nprod, r->ncons, r->msgsize, r->block ? "block" : "poll", r->secs,
+           (unsigned long long)r->msgs, (unsigned long long)r->bytes, mbps, mps,
+           (unsigned long long)r->p50, (unsigned long long)r->p99, (unsigned long long)r->p999,
+           r->nvcsw, r->nivcsw,
+           (unsigned long long)r->ks.wr_blocked, (unsigned long long)r->ks.rd_blocked,
+           (unsigned long long)r->ks.wakeups, (unsigned long long)r->ks.wakeups_avoided);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "syntax: %s [options]\n"
+            "  -d dev[,dev...]   device files (default /dev/pchar0)\n"
+            "  -n N[,N...]       device counts, first N of -d (default: all)\n"
+            "  -b SIZE[,SIZE...] buffer sizes, k/m suffix, 0 = leave as is (default 0)\n"
+            "  -p N[,N...]       producer threads (default 1)\n"
+            "  -c N[,N...]       consumer threads (default 1)\n"
+            "  -s SIZE[,SIZE...] message sizes (default 64)\n"
+            "  -m block|poll     blocking read/write, or O_NONBLOCK + poll() (default block)\n"
+            "  -t SECS           seconds per run (default 2)\n"
+            "  -f csv|json       output format (default csv)\n", prog);
+    _exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    char *paths[MAX_DEVS];
+    char *devs = "/dev/pchar0";
+    struct list ndevs = { 0 }, bufs = { 1, { 0 } }, prods = { 1, { 1 } };
+    struct list conss = { 1, { 1 } }, sizes = { 1, { 64 } };
+    struct sigaction sa = { .sa_handler = kick };
+    double secs = 2.0;
+    int block = 1, json = 0, first = 1, npaths = 0, opt, a, b, c, d, e;
+    char *tok, *save = NULL;
+
+    while ((opt = getopt(argc, argv, "d:n:b:p:c:s:m:t:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': devs = optarg; break;
+        case 'n': if (parse_list(optarg, &ndevs) < 0) usage(argv[0]); break;
+        case 'b': if (parse_list(optarg, &bufs) < 0) usage(argv[0]); break;
+        case 'p': if (parse_list(optarg, &prods) < 0) usage(argv[0]); break;
+        case 'c': if (parse_list(optarg, &conss) < 0) usage(argv[0]); break;
+        case 's': if (parse_list(optarg, &sizes) < 0) usage(argv[0]); break;
+        case 'm':
+            if (strcmp(optarg, "block") && strcmp(optarg, "poll"))
+                usage(argv[0]);
+            block = !strcmp(optarg, "block");
+            break;
+        case 't': secs = atof(optarg); break;
+        case 'f': json = !strcmp(optarg, "json"); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (secs <= 0)
+        usage(argv[0]);
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    devs = strdup(devs);
+    for (tok = strtok_r(devs, ",", &save); tok && npaths < MAX_DEVS; tok = strtok_r(NULL, ",", &save))
+        paths[npaths++] = tok;
+    if (npaths == 0)
+        usage(argv[0]);
+    if (ndevs.n == 0)
+    {
+        ndevs.n = 1;
+        ndevs.v[0] = npaths;
+    }
+
+    if (json)
+        printf("[\n");
+    else
+        printf("devices,bufsize,producers,consumers,msgsize,mode,secs,msgs,bytes,mb_per_s,msgs_per_s,"
+               "p50_ns,p99_ns,p999_ns,vol_csw,invol_csw,wr_blocked,rd_blocked,wakeups,wakeups_avoided\n");
+
+    for (a = 0; a < ndevs.n; a++)
+        for (b = 0; b < bufs.n; b++)
+            for (c = 0; c < prods.n; c++)
+                for (d = 0; d < conss.n; d++)
+                    for (e = 0; e < sizes.n; e++)
+                    {
+                        struct result r;
+                        int nd = ndevs.v[a];
+                        if (nd < 1 || nd > npaths || prods.v[c] < 1 || conss.v[d] < 1 || sizes.v[e] < 1)
+                        {
+                            fprintf(stderr, "skipping devices=%d producers=%ld consumers=%ld msgsize=%ld\n",
+                                    nd, prods.v[c], conss.v[d], sizes.v[e]);
+                            continue;
+                        }
+                        if (bufs.v[b] && sizes.v[e] > bufs.v[b])
+                        {
+                            fprintf(stderr, "skipping msgsize=%ld > bufsize=%ld\n", sizes.v[e], bufs.v[b]);
+                            continue;
+                        }
+                        if (run(paths, nd, bufs.v[b], prods.v[c], conss.v[d], sizes.v[e], block, secs, &r) < 0)
+                        {
+                            fprintf(stderr, "run failed: devices=%d bufsize=%ld producers=%ld consumers=%ld msgsize=%ld\n",
+                                    nd, bufs.v[b], prods.v[c], conss.v[d], sizes.v[e]);
+                            continue;
+                        }
+                        print_result(&r, json, first);
+                        first = 0;
+                    }
+
+    if (json)
+        printf("\n]\n");
+    free(devs);
+    return 0;
+}
+
+// cmd> make                  # builds the module and pchar_bench
+// cmd> sudo insmod assign2.ko devcnt=4
+// cmd> sudo ./pchar_bench -d /dev/pchar0,/dev/pchar1,/dev/pchar2,/dev/pchar3 -n 1,4 -b 4k,64k -p 1,4 -c 1,4 -s 8,64,1024 > before.csv
+// cmd> sudo ./pchar_bench -f json -s 64,4096 > run.json
+// cmd> sudo ./pchar_bench -m poll -p 4 -c 4 > poll.csv
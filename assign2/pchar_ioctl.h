@@ -0,0 +1,203 @@
+#ifndef __PCHAR_IOCTL_H
+#define __PCHAR_IOCTL_H
+
+#include<linux/ioctl.h>
+#include<linux/types.h>
+
+// mmap ring mode -- control page shared with user space.
+// mmap() the device (offset 0) after FIFO_RING_SETUP: the first page holds this
+// struct, ring data starts at data_off. head/tail are free running byte counts,
+// index into data with (idx & (size - 1)). Producer only writes head, consumer
+// only writes tail (use acquire loads/release stores on both sides).
+// head, tail and the read-only fields each sit on a 64 byte cache line of
+// their own, so producer and consumer do not bounce a shared line.
+// FIFO_RING_SETUP fails with EBUSY while data is queued in the device.
+struct pchar_ring_ctrl
+{
+    __u32 head;     // next byte to be written by producer
+    __u32 pad0[15];
+    __u32 tail;     // next byte to be read by consumer
+    __u32 pad1[15];
+    __u32 size;     // data area size in bytes (power of 2)
+    __u32 data_off; // offset of data area in the mapping
+    __u32 pad2[14];
+};
+
+// one message of a FIFO_WRITE_BATCH / FIFO_READ_BATCH request
+struct fifo_msg
+{
+    __u64 buf;  // user buffer address
+    __u32 len;  // in: buffer length; out (read batch): bytes read
+    __u32 pad;
+};
+
+// batch request -- the ioctl returns the number of messages completed (like sendmmsg)
+struct fifo_batch
+{
+    __u64 msgs;  // address of struct fifo_msg array
+    __u32 count; // number of messages in the array (<= FIFO_BATCH_MAX)
+    __u32 done;  // out: number of messages completed
+};
+
+#define FIFO_BATCH_MAX 1024
+
+// FIFO_GET_STATS -- per device counters, all 64 bit. version is set by the
+// driver; new fields are only ever appended (and FIFO_STATS_VERSION bumped).
+#define FIFO_STATS_VERSION 2
+struct fifo_stats
+{
+    __u32 version;     // FIFO_STATS_VERSION of the driver
+    __u32 pad;
+    __u64 size;        // buffer size (bytes)
+    __u64 length;      // bytes queued now
+    __u64 avail;       // bytes free now
+    __u64 high_water;  // highest fill level seen (bytes)
+    __u64 bytes_in;    // bytes written
+    __u64 bytes_out;   // bytes read
+    __u64 writes;      // write ops
+    __u64 reads;       // read ops
+    __u64 wr_blocked;  // times a writer slept on a full buffer
+    __u64 rd_blocked;  // times a reader slept on an empty buffer
+    __u64 drops;       // bytes dropped
+    __u64 errors;      // failed transfers
+    // version 2
+    __u64 wakeups;          // wakeups that found a blocked process
+    __u64 wakeups_avoided;  // wake-one wakeups that left other blocked processes asleep
+};
+
+// FIFO_RESIZE2 -- resize while traffic flows. Without FIFO_RESIZE_TRUNCATE a
+// resize that cannot keep all queued data fails with ENOSPC. truncated reports
+// the bytes dropped (or that would have been dropped).
+#define FIFO_RESIZE_TRUNCATE 0x1 // drop the newest bytes that do not fit
+struct fifo_resize
+{
+    __u32 size;       // new size in bytes (rounded up to a power of 2) of each
+                      // queue; all queues together at most 512 MiB, else EINVAL
+    __u32 flags;      // FIFO_RESIZE_*
+    __u64 truncated;  // out: bytes dropped
+};
+
+// FIFO_SET_WRITE_MODE -- write() semantics. A write of up to atomic_size bytes
+// lands whole or not at all: it blocks until there is room for all of it, or
+// fails with EAGAIN on a non-blocking fd (0: writes take whatever fits).
+// With FIFO_WRITE_ALL a blocking write() returns only once the entire request
+// is queued (or on a signal, with the bytes queued so far).
+#define FIFO_WRITE_ALL 0x1
+struct fifo_write_mode
+{
+    __u32 atomic_size; // bytes, <= buffer size to be useful
+    __u32 flags;       // FIFO_WRITE_*
+};
+
+// FIFO_SET_WATERMARK -- wakeup moderation, like NIC interrupt coalescing.
+// Readers are woken once rd_wmark bytes are queued, writers once wr_wmark bytes
+// are free (0 or 1: on every transfer). A held back wakeup is delivered after
+// at most flush_ns (0: only when the other side is about to block).
+struct fifo_watermark
+{
+    __u32 rd_wmark;   // bytes queued before readers are woken
+    __u32 wr_wmark;   // bytes free before writers are woken
+    __u64 flush_ns;   // latency bound for a held back wakeup, <= 1s
+};
+
+// FIFO_GET_SEQ -- seq counts the bytes (records in record mode) ever taken off
+// the head of the buffer, read or dropped: the sequence number of the next one
+// read() returns. A reader that got n since the last call expects seq to have
+// moved by n -- any more is a gap. lost counts the ones dropped unread. The
+// unit is that of the current mode: FIFO_SET_RECORD resets both to 0.
+struct fifo_seq
+{
+    __u64 seq;
+    __u64 lost;
+};
+
+// FIFO_PEEK -- copy what the next read() would return without consuming it.
+// In record mode that is the next record, cut to len; the ioctl then returns
+// the full record length (else the bytes copied). Never waits: EAGAIN if empty.
+struct fifo_peek
+{
+    __u64 buf;  // user buffer address
+    __u32 len;  // in: buffer length; out: bytes copied
+    __u32 pad;
+};
+
+#define FIFO_RESIZE  _IOW('x',3,int)      // param: new size, never truncates
+#define FIFO_RING_SETUP _IOW('x',4,int)   // param: ring data size (power of 2, >= page size)
+#define FIFO_RING_KICK  _IO('x',5)        // wake up poll()ers after moving head/tail
+#define FIFO_WRITE_BATCH _IOWR('x',6,struct fifo_batch)
+#define FIFO_READ_BATCH  _IOWR('x',7,struct fifo_batch)
+// declare this fd the only producer/consumer of the device (until close):
+// its read()/write() then skip the device lock, other fds get -EBUSY.
+// the caller must not use the fd from several threads at once.
+#define FIFO_CLAIM_PRODUCER _IO('x',8)
+#define FIFO_CLAIM_CONSUMER _IO('x',9)
+#define FIFO_GET_STATS _IOWR('x',10,struct fifo_stats)
+#define FIFO_RESIZE2 _IOWR('x',11,struct fifo_resize)
+// record mode -- each write() is one record, each read() returns one whole record
+// (EMSGSIZE if the buffer is too small). param: 1 = records, 0 = byte stream.
+// Only an empty device switches (else EBUSY).
+#define FIFO_SET_RECORD _IOW('x',12,int)
+#define FIFO_SET_WATERMARK _IOW('x',13,struct fifo_watermark)
+#define FIFO_SET_WRITE_MODE _IOW('x',14,struct fifo_write_mode)
+// broadcast (fan-out) mode -- every reader gets every byte (or record). One
+// shared buffer, each open fd reads at its own cursor and joins at the end of
+// the data; space is freed once all readers are past it. Policy for slow readers:
+// FIFO_BCAST_BLOCK: the slowest reader holds the writers back (backpressure).
+// FIFO_BCAST_LAG: writers never wait for readers -- the oldest data is dropped
+// (counted in drops) and a reader that missed some gets EOVERFLOW once, then
+// goes on with the oldest data still held.
+// Not with sharded queues, lanes, the mmap ring or FIFO_READ_BATCH. Only an empty
+// device switches on/off (else EBUSY); the policy can change any time.
+#define FIFO_BCAST_OFF   0
+#define FIFO_BCAST_BLOCK 1
+#define FIFO_BCAST_LAG   2
+#define FIFO_SET_BROADCAST _IOW('x',17,int) // param: FIFO_BCAST_*
+// chaining -- forward everything queued on this device into another pchar device,
+// fifo to fifo inside the kernel. param: an fd open for writing on the downstream
+// device (EBADF otherwise, like splice), -1 to unlink. When the downstream device
+// is full, data backs up here and our writers block -- unless it is in overwrite
+// mode, which drops its oldest data instead.
+// Framing follows each side: records are forwarded whole, bytes as they come.
+// A device forwards to one device and is fed by at most one; no loops (ELOOP).
+// Not with sharded queues, lanes, the mmap ring or broadcast mode, nor from a
+// device in overwrite mode.
+#define FIFO_LINK _IOW('x',18,int)
+#define FIFO_PEEK _IOWR('x',19,struct fifo_peek)
+// drop the next param bytes (records in record mode) without copying them out.
+// returns the number dropped, 0 if the device is empty.
+#define FIFO_SKIP _IOW('x',20,int)
+// priority lanes -- a device created with lanes (module param lanes=, or
+// pchar_ctl_req.lanes) has that many sub-queues, each the full buffer size.
+// FIFO_SET_LANE picks the lane this fd writes to (param: 0 = lowest, the
+// default, up to lanes - 1). Readers always take the highest non-empty lane.
+// FIFO_SET_LANE_QUOTA is the starvation guard: after param reads in a row from
+// a higher lane while a lower one waits, one read serves the lowest waiting
+// lane (0: off, strict priority).
+#define FIFO_LANES_MAX 8
+#define FIFO_SET_LANE _IOW('x',21,int)
+#define FIFO_SET_LANE_QUOTA _IOW('x',22,int)
+// overwrite (flight recorder) mode -- a write into a full buffer drops the oldest
+// bytes (whole records in record mode, counted in drops) instead of blocking or
+// failing -- even the data a reader is copying out right then, whose read then
+// goes on with the oldest data left. param: 1 = on, 0 = off. Not with broadcast
+// mode (see FIFO_BCAST_LAG), nor on a device that forwards (FIFO_LINK).
+#define FIFO_SET_OVERWRITE _IOW('x',23,int)
+#define FIFO_GET_SEQ _IOR('x',24,struct fifo_seq)
+
+// /dev/pchar_ctl -- create/destroy device instances at runtime. name may hold
+// letters, digits, '-' and '_' (else EINVAL); the node is /dev/pchar-<name>
+// (e.g. "tenant1" -> /dev/pchar-tenant1). The load time ones are pchar0, pchar1, ...
+// DESTROY takes the same name and fails with EBUSY while the device is open.
+#define PCHAR_NAME_MAX 32
+struct pchar_ctl_req
+{
+    char name[PCHAR_NAME_MAX]; // NUL terminated instance name (without "pchar-")
+    __u32 size;                // CREATE: buffer size in bytes (0: default)
+    __u32 minor;               // CREATE out: minor number of the new device
+    __s32 node;                // CREATE: NUMA node for state and buffers (-1: any)
+    __u32 lanes;               // CREATE: priority lanes, <= FIFO_LANES_MAX (0: none)
+};
+#define PCHAR_CTL_CREATE  _IOWR('x',15,struct pchar_ctl_req)
+#define PCHAR_CTL_DESTROY _IOW('x',16,struct pchar_ctl_req)
+
+#endif